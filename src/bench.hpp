@@ -0,0 +1,186 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include "capture/outputs.hpp"
+#include "capture/region.hpp"
+#include "screen_textures.hpp"
+#include "pixmap_textures.hpp"
+
+using BenchClock = std::chrono::steady_clock;
+using BenchMs = std::chrono::duration<double, std::milli>;
+
+// Time spent in each stage over a whole benchmark run
+struct BenchTimes {
+	double captureMs;
+	double uploadMs;
+	double renderMs;
+	std::uint64_t uploaded;
+};
+
+// Draws one frame and waits for it, the same way the render loop would
+static void benchRender(GLFWwindow* window, GLuint program, ScreenTextures& st) {
+	glClear(GL_COLOR_BUFFER_BIT);
+	updateUniforms(program);
+	drawScreenTextures(st);
+	glfwSwapBuffers(window);
+	glFinish();
+	glfwPollEvents();
+}
+
+static void printBenchmark(const char* name, int frames, const ScreenTextures& st, const BenchTimes& t, double seconds) {
+	printf("[BENCH] %d frames of %dx%d with '%s'\n", frames, st.width, st.height, name);
+	printf("[BENCH] capture %.3f ms, upload %.3f ms, render %.3f ms per frame\n",
+		t.captureMs / frames, t.uploadMs / frames, t.renderMs / frames);
+	printf("[BENCH] %.1f frames/s, %.1f MB/s uploaded\n",
+		frames / seconds, t.uploaded / seconds / (1024.0 * 1024.0));
+}
+
+// Runs `frames` rounds of capture -> upload -> render as fast as possible,
+// the same way the render loop would, and prints where the time went.
+// Uploads and draws are waited for with glFinish so each stage is timed on
+// its own. Meant to be paired with the synthetic or file backends to get
+// numbers that are comparable between runs.
+//
+// Full captures are started before the previous frame is drawn and only
+// waited for afterwards, so backends that capture in the background (e.g.
+// x11-shm-pixmap) only count the time they actually block for.
+void runBenchmark(GLFWwindow* window, GLuint program, OutputCaptures& oc, ScreenTextures& st, int frames) {
+	glfwSwapInterval(0);
+
+	BenchTimes times{};
+	BenchClock::time_point begin = BenchClock::now();
+
+	for (int f = 0; f < frames; f++) {
+		BenchClock::time_point t0 = BenchClock::now();
+
+		DirtyRegion region;
+		bool tracked = false;
+		for (auto& src : oc.sources) {
+			tracked = src->pollDamage(region) || tracked;
+		}
+
+		for (auto& src : oc.sources) {
+			if (!tracked) {
+				src->beginGrab();
+				continue;
+			}
+			src->grab(region);
+		}
+
+		BenchClock::time_point t1 = BenchClock::now();
+
+		// the previous frame
+		benchRender(window, program, st);
+
+		BenchClock::time_point t2 = BenchClock::now();
+
+		for (auto& src : oc.sources) {
+			src->finishGrab();
+		}
+
+		BenchClock::time_point t3 = BenchClock::now();
+
+		for (std::size_t i = 0; i < oc.sources.size(); i++) {
+			const CaptureSource& src = *oc.sources[i];
+			ImageView img = src.image();
+
+			if (!tracked) {
+				region.clear();
+				region.add(src.area());
+			}
+
+			for (const Rect& rect : region.rects()) {
+				Rect r = rect.intersect(src.area());
+				if (r.empty()) {
+					continue;
+				}
+
+				uploadScreenTexture(st, i, r,
+					img.data + (std::size_t)(r.y - src.area().y) * img.stride + (std::size_t)(r.x - src.area().x) * bytesPerPixel(img.format),
+					img.stride,
+					img.format
+				);
+				times.uploaded += (std::uint64_t)r.area() * bytesPerPixel(img.format);
+			}
+		}
+		glFinish();
+
+		BenchClock::time_point t4 = BenchClock::now();
+
+		times.captureMs += BenchMs(t1 - t0).count() + BenchMs(t3 - t2).count();
+		times.renderMs += BenchMs(t2 - t1).count();
+		times.uploadMs += BenchMs(t4 - t3).count();
+	}
+
+	double seconds = std::chrono::duration<double>(BenchClock::now() - begin).count();
+	printBenchmark(oc.sources.empty() ? "none" : oc.sources[0]->name(), frames, st, times, seconds);
+}
+
+// Times `grabs` full captures of `area` with 1 to `maxBands` bands (see
+// BandedShmSource) and prints how each count compares to a single
+// connection. Capture only, nothing is uploaded or drawn.
+void runBandBenchmark(Display* display, const Rect& area, int maxBands, int grabs) {
+	double single = 0.0;
+	for (int n = 1; n <= maxBands; n++) {
+		BandedShmSource src("x11-shm-bands:" + std::to_string(n));
+		if (!src.open(display, area)) {
+			fprintf(stderr, "[WARN] Couldn't open a capture in %d bands\n", n);
+			return;
+		}
+
+		// the first capture pays for faulting the segment in
+		src.grab();
+
+		BenchClock::time_point begin = BenchClock::now();
+		for (int i = 0; i < grabs; i++) {
+			src.grab();
+		}
+		double ms = BenchMs(BenchClock::now() - begin).count() / grabs;
+		if (n == 1) {
+			single = ms;
+		}
+
+		double mb = (double)area.area() * bytesPerPixel(src.image().format) / (1024.0 * 1024.0);
+		printf("[BENCH] %2d bands: %.3f ms per capture, %.1f MB/s, %.2fx\n",
+			n, ms, mb / (ms / 1000.0), single / ms);
+	}
+}
+
+// Same as runBenchmark for the zero-copy path: every frame copies the whole
+// screen into the pixmaps and rebinds them. There is no upload stage, the
+// copy is counted as capture.
+void runPixmapBenchmark(GLFWwindow* window, GLuint program, PixmapTextures& pt, ScreenTextures& st, int frames) {
+	glfwSwapInterval(0);
+
+	DirtyRegion all;
+	all.add(Rect{0, 0, st.width, st.height});
+
+	BenchTimes times{};
+	BenchClock::time_point begin = BenchClock::now();
+
+	for (int f = 0; f < frames; f++) {
+		BenchClock::time_point t0 = BenchClock::now();
+
+		refreshPixmapTextures(pt, st, all);
+		glFinish();
+
+		BenchClock::time_point t1 = BenchClock::now();
+
+		benchRender(window, program, st);
+
+		BenchClock::time_point t2 = BenchClock::now();
+
+		times.captureMs += BenchMs(t1 - t0).count();
+		times.renderMs += BenchMs(t2 - t1).count();
+	}
+
+	double seconds = std::chrono::duration<double>(BenchClock::now() - begin).count();
+	printBenchmark(PIXMAP_BACKEND, frames, st, times, seconds);
+}
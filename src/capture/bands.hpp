@@ -0,0 +1,301 @@
+#pragma once
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "region.hpp"
+#include "shm.hpp"
+#include "shm_segment.hpp"
+#include "source.hpp"
+
+// Most connections a banded capture opens
+const int MAX_CAPTURE_BANDS = 16;
+// Bands used when the backend is asked for without a count
+const int DEFAULT_CAPTURE_BANDS = 4;
+
+// Number of bands asked for by "x11-shm-bands[:N]"
+int captureBandCount(const std::string& spec) {
+	std::size_t colon = spec.find(':');
+	int count = colon == std::string::npos ? DEFAULT_CAPTURE_BANDS : std::atoi(spec.c_str() + colon + 1);
+	return std::clamp(count, 1, MAX_CAPTURE_BANDS);
+}
+
+// One horizontal band of a banded capture, read on a connection and thread
+// of its own
+struct CaptureBand {
+	Display* display;
+	std::shared_ptr<ShmSegment> segment;
+	// rows of the shared image, written in place by the server
+	XImage* image;
+	// in root coordinates
+	Rect rect;
+	bool ok;
+	std::thread thread;
+};
+
+// MIT-SHM backend for very large areas: the area is split into horizontal
+// bands, each read by its own X connection and thread into its slice of a
+// single segment, so the server can work on several bands at once and no
+// connection has to carry the whole area.
+//
+// Bands read at different times would tear, so every full capture first
+// copies the area into a pixmap with a single XCopyArea, which the server
+// carries out atomically, and the bands are read from that copy. No server
+// grab is involved: it would hold off the band connections themselves.
+//
+// The first band is read over the connection the source was opened on.
+// Partial captures are small and go through that connection alone, straight
+// from the root window. With a single band this is x11-shm.
+class BandedShmSource : public CaptureSource {
+public:
+	explicit BandedShmSource(const std::string& spec) : count(captureBandCount(spec)) {}
+
+	~BandedShmSource() override {
+		close();
+	}
+
+	const char* name() const override {
+		return "x11-shm-bands";
+	}
+
+	bool open(Display* display, const Rect& area) override {
+		if (!initShmCapture(cap, display, area)) {
+			return false;
+		}
+		opened = true;
+		bounds = area;
+
+		// Bands cover the area between them, so if some connection can't
+		// be opened the area is split again across those that could
+		int bandCount = std::min(count, area.height);
+		while (bandCount > 1 && !openBands(area, bandCount)) {
+			int connections = (int)bands.size() + 1;
+			fprintf(stderr, "[WARN] Banded capture: only %d of %d connections could be opened\n",
+				connections, bandCount);
+			closeBands();
+			bandCount = connections;
+		}
+
+		if (!bands.empty()) {
+			snapshot = XCreatePixmap(display, cap.drawable, area.width, area.height, cap.depth);
+			XGCValues values{};
+			values.subwindow_mode = IncludeInferiors;
+			gc = XCreateGC(display, cap.drawable, GCSubwindowMode, &values);
+		}
+
+		running = true;
+		for (auto& band : bands) {
+			band->thread = std::thread(&BandedShmSource::work, this, band.get());
+		}
+
+		firstRows = bands.empty() ? area.height : bands[0]->rect.y - area.y;
+		printf("[INFO] Capturing %dx%d in %zu bands\n", area.width, area.height, bands.size() + 1);
+		return true;
+	}
+
+	ImageView image() const override {
+		return ImageView{
+			(const std::uint8_t*)cap.image->data,
+			cap.width,
+			cap.height,
+			cap.image->bytes_per_line,
+			cap.format
+		};
+	}
+
+	// Copies the area and sets the band connections reading it. The first
+	// band is read by finishGrab.
+	bool beginGrab() override {
+		if (bands.empty()) {
+			return true;
+		}
+
+		XCopyArea(cap.display, cap.drawable, snapshot, gc, cap.x, cap.y, cap.width, cap.height, 0, 0);
+		// the bands are read over other connections, which only see the
+		// copy once this one had it carried out
+		XSync(cap.display, False);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		generation++;
+		pending = bands.size();
+		wakeBands.notify_all();
+		return true;
+	}
+
+	bool finishGrab() override {
+		if (bands.empty()) {
+			return capture(cap);
+		}
+
+		XImage* first = XShmCreateImage(cap.display, cap.visual, cap.depth, ZPixmap,
+			cap.image->data, &cap.segment->info, cap.width, firstRows);
+		bool ok = first && XShmGetImage(cap.display, snapshot, first, 0, 0, AllPlanes);
+		if (first) {
+			XDestroyImage(first);
+		}
+
+		std::unique_lock<std::mutex> lock(mutex);
+		bandsDone.wait(lock, [&] { return pending == 0; });
+		for (const auto& band : bands) {
+			ok = ok && band->ok;
+		}
+		return ok;
+	}
+
+protected:
+	bool doGrab() override {
+		return beginGrab() && finishGrab();
+	}
+
+	bool doGrabRect(const Rect& r) override {
+		if (!cap.scratch && !scratchFailed) {
+			scratchFailed = !attachShmScratch(cap, (std::size_t)cap.image->bytes_per_line * cap.height / 2);
+		}
+		return captureRect(cap, r);
+	}
+
+#ifdef CAPTURE_SHM_FD
+	bool doGrabRects(const std::vector<Rect>& rects) override {
+		if (!cap.scratch && !scratchFailed) {
+			scratchFailed = !attachShmScratch(cap, (std::size_t)cap.image->bytes_per_line * cap.height / 2);
+		}
+		return captureRects(cap, rects);
+	}
+#endif
+
+private:
+	// Opens the connections of bands 1 to `bandCount` - 1 of `area`, band 0
+	// being read over the source's own. Stops at the first that fails.
+	bool openBands(const Rect& area, int bandCount) {
+		for (int i = 1; i < bandCount; i++) {
+			int y0 = area.height * i / bandCount;
+			int y1 = area.height * (i + 1) / bandCount;
+			if (!openBand(Rect{area.x, area.y + y0, area.width, y1 - y0})) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Opens a connection for `rect` and gives it the rows of the shared
+	// image that `rect` covers
+	bool openBand(const Rect& rect) {
+		auto band = std::make_unique<CaptureBand>();
+		band->rect = rect;
+		band->display = XOpenDisplay(DisplayString(cap.display));
+		if (!band->display) {
+			return false;
+		}
+
+		band->segment = shareShmSegment(cap.segment, band->display);
+		if (!band->segment) {
+			XCloseDisplay(band->display);
+			return false;
+		}
+
+		// Visuals belong to a connection, the default one is the same on both
+		int screen = DefaultScreen(band->display);
+		band->image = XShmCreateImage(band->display, DefaultVisual(band->display, screen), cap.depth, ZPixmap,
+			cap.image->data + (std::size_t)(rect.y - cap.y) * cap.image->bytes_per_line,
+			&band->segment->info, rect.width, rect.height);
+		if (!band->image) {
+			band->segment.reset();
+			XCloseDisplay(band->display);
+			return false;
+		}
+
+		bands.push_back(std::move(band));
+		return true;
+	}
+
+	void work(CaptureBand* band) {
+		std::uint64_t seen = 0;
+		// in the snapshot
+		int y = band->rect.y - cap.y;
+
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wakeBands.wait(lock, [&] { return !running || generation != seen; });
+				if (!running) {
+					return;
+				}
+				seen = generation;
+			}
+
+			bool ok = XShmGetImage(band->display, snapshot, band->image, 0, y, AllPlanes);
+
+			std::lock_guard<std::mutex> lock(mutex);
+			band->ok = ok;
+			if (--pending == 0) {
+				bandsDone.notify_one();
+			}
+		}
+	}
+
+	void closeBands() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			running = false;
+			wakeBands.notify_all();
+		}
+
+		for (auto& band : bands) {
+			if (band->thread.joinable()) {
+				band->thread.join();
+			}
+			XDestroyImage(band->image);
+			band->segment.reset();
+			XCloseDisplay(band->display);
+		}
+		bands.clear();
+	}
+
+	void close() {
+		closeBands();
+
+		if (gc) {
+			XFreeGC(cap.display, gc);
+			gc = nullptr;
+		}
+		if (snapshot) {
+			XFreePixmap(cap.display, snapshot);
+			snapshot = None;
+		}
+		if (opened) {
+			destroyShmCapture(cap);
+			opened = false;
+		}
+	}
+
+	int count;
+	ShmCapture cap{};
+	bool opened = false;
+	bool scratchFailed = false;
+
+	Pixmap snapshot = None;
+	GC gc = nullptr;
+	// rows read over cap.display
+	int firstRows = 0;
+	std::vector<std::unique_ptr<CaptureBand>> bands;
+
+	std::mutex mutex;
+	std::condition_variable wakeBands;
+	std::condition_variable bandsDone;
+	// bumped for every capture the bands are woken for
+	std::uint64_t generation = 0;
+	std::size_t pending = 0;
+	bool running = false;
+};
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <X11/Xlib.h>
+
+#include "region.hpp"
+#include "source.hpp"
+#include "shm.hpp"
+#include "bands.hpp"
+#include "shm_pixmap.hpp"
+#include "xgetimage.hpp"
+#include "synthetic.hpp"
+#include "file.hpp"
+
+#ifdef CAPTURE_XCOMPOSITE
+#include "window.hpp"
+#endif
+
+#if defined(CAPTURE_XCOMPOSITE) && defined(CAPTURE_XDAMAGE) && defined(CAPTURE_XRENDER)
+#include "desktop.hpp"
+#endif
+
+// Every backend, in the order they are tried before anything was measured
+const char* const CAPTURE_BACKENDS[] = {
+	"x11-shm",
+	"x11-shm-pixmap",
+	"x11-getimage",
+};
+
+// Backends that don't capture the screen but stand in for it, e.g. a single
+// window, or test frames for benchmarking. They are only used when asked
+// for, and bring their own size.
+const char* const STANDALONE_BACKENDS[] = {
+	"synthetic",
+	"file",
+#ifdef CAPTURE_XCOMPOSITE
+	"window",
+#endif
+};
+
+// How many full captures each backend gets when they are compared
+const int CAPTURE_BENCH_GRABS = 3;
+
+// Backend name without its options, e.g. "synthetic" for "synthetic:640x480"
+std::string backendName(const std::string& spec) {
+	return spec.substr(0, spec.find(':'));
+}
+
+bool isStandaloneBackend(const std::string& spec) {
+	for (const char* b : STANDALONE_BACKENDS) {
+		if (backendName(spec) == b) {
+			return true;
+		}
+	}
+	return false;
+}
+
+std::unique_ptr<CaptureSource> createCaptureSource(const std::string& name) {
+	if (backendName(name) == "synthetic") {
+		return std::make_unique<SyntheticSource>(name);
+	}
+	if (backendName(name) == "file") {
+		return std::make_unique<FileSource>(name);
+	}
+#ifdef CAPTURE_XCOMPOSITE
+	if (backendName(name) == "window") {
+		return std::make_unique<WindowSource>(name);
+	}
+#endif
+#if defined(CAPTURE_XCOMPOSITE) && defined(CAPTURE_XDAMAGE) && defined(CAPTURE_XRENDER)
+	if (backendName(name) == "desktop") {
+		return std::make_unique<DesktopSource>(name);
+	}
+#endif
+	if (backendName(name) == "x11-shm-bands") {
+		return std::make_unique<BandedShmSource>(name);
+	}
+	if (name == "x11-shm") {
+		return std::make_unique<ShmSource>();
+	}
+	if (name == "x11-shm-pixmap") {
+		return std::make_unique<ShmPixmapSource>();
+	}
+	if (name == "x11-getimage") {
+		return std::make_unique<XGetImageSource>();
+	}
+	return nullptr;
+}
+
+bool isCaptureBackend(const std::string& name) {
+	for (const char* b : CAPTURE_BACKENDS) {
+		if (name == b) {
+			return true;
+		}
+	}
+	// opens connections of its own, only worth it on very large screens
+	if (backendName(name) == "x11-shm-bands") {
+		return true;
+	}
+#if defined(CAPTURE_XCOMPOSITE) && defined(CAPTURE_XDAMAGE) && defined(CAPTURE_XRENDER)
+	// captures the screen like the backends above, but costs more and is
+	// only worth it to leave a window out, so it is never picked by itself
+	if (backendName(name) == "desktop") {
+		return true;
+	}
+#endif
+	return isStandaloneBackend(name);
+}
+
+// Picks a capture backend at runtime.
+//
+// The first open tries every backend, times a few full captures with each
+// one that works and keeps the fastest. From then on backends are tried
+// fastest first, and a backend that fails to open falls through to the next.
+//
+// Captures are timed through grab(), start to finish with nothing in
+// between, i.e. by how long they block the caller. Backends that capture in
+// the background (x11-shm-pixmap) are compared without what they could hide
+// behind other work, and pay their completion round-trip on top.
+struct CaptureChain {
+	std::vector<std::string> order;
+	bool measured;
+};
+
+// `forced`, if not empty, is tried first and without being measured
+void initCaptureChain(CaptureChain& chain, const std::string& forced = "") {
+	chain = CaptureChain{};
+
+	if (!forced.empty()) {
+		chain.order.push_back(forced);
+		chain.measured = true;
+	}
+
+	// standalone backends never fall back to the whole screen, and neither
+	// does the desktop: it is asked for to leave a window out, which the
+	// root backends would capture
+	if (isStandaloneBackend(forced) || backendName(forced) == "desktop") {
+		return;
+	}
+
+	for (const char* b : CAPTURE_BACKENDS) {
+		if (forced != b) {
+			chain.order.push_back(b);
+		}
+	}
+}
+
+// Returns a source ready to capture `area`, or nullptr if no backend works.
+std::unique_ptr<CaptureSource> openCaptureSource(CaptureChain& chain, Display* display, const Rect& area) {
+	if (chain.measured) {
+		for (const std::string& name : chain.order) {
+			std::unique_ptr<CaptureSource> src = createCaptureSource(name);
+			if (src && src->open(display, area)) {
+				return src;
+			}
+			fprintf(stderr, "[WARN] Capture backend '%s' failed, trying the next one\n", name.c_str());
+		}
+		return nullptr;
+	}
+
+	std::vector<std::unique_ptr<CaptureSource>> working;
+	std::vector<std::string> broken;
+
+	for (const std::string& name : chain.order) {
+		std::unique_ptr<CaptureSource> src = createCaptureSource(name);
+		if (!src || !src->open(display, area)) {
+			broken.push_back(name);
+			continue;
+		}
+
+		bool ok = true;
+		for (int i = 0; i < CAPTURE_BENCH_GRABS && ok; i++) {
+			ok = src->grab();
+		}
+
+		if (!ok) {
+			fprintf(stderr, "[WARN] Capture backend '%s' opened but failed to capture\n", name.c_str());
+			broken.push_back(name);
+			continue;
+		}
+
+		printf("[INFO] Capture backend '%s': %.2f ms per frame\n", name.c_str(), src->cost());
+		working.push_back(std::move(src));
+	}
+
+	std::stable_sort(working.begin(), working.end(), [](const auto& a, const auto& b) {
+		return a->cost() < b->cost();
+	});
+
+	chain.order.clear();
+	for (const auto& src : working) {
+		chain.order.push_back(src->name());
+	}
+	chain.order.insert(chain.order.end(), broken.begin(), broken.end());
+	chain.measured = true;
+
+	if (working.empty()) {
+		return nullptr;
+	}
+
+	printf("[INFO] Using capture backend '%s'\n", working[0]->name());
+	return std::move(working[0]);
+}
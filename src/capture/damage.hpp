@@ -0,0 +1,98 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+
+#include <X11/Xlib.h>
+#include <X11/extensions/Xdamage.h>
+#include <X11/extensions/Xfixes.h>
+
+#include "region.hpp"
+#include "source.hpp"
+
+// Tracks which parts of a drawable, normally the root window, changed since
+// the last call to collect(), using the XDamage extension.
+struct DamageTracker {
+	Display* display;
+	Damage damage;
+	XserverRegion parts;
+	int eventBase;
+	bool pending;
+	// first change reported since the last collectDamage()
+	ChangeStamp since;
+};
+
+// Returns false if the server lacks XDamage/XFixes, in which case the caller
+// should treat every frame as fully damaged.
+bool initDamageTracker(DamageTracker& dt, Display* display, Drawable drawable) {
+	dt = DamageTracker{};
+	dt.display = display;
+
+	int errorBase;
+	if (!XDamageQueryExtension(display, &dt.eventBase, &errorBase)) {
+		fprintf(stderr, "[WARN] XDamage is not available, live mode will capture full frames\n");
+		return false;
+	}
+
+	int fixesEvent, fixesError;
+	if (!XFixesQueryExtension(display, &fixesEvent, &fixesError)) {
+		fprintf(stderr, "[WARN] XFixes is not available, live mode will capture full frames\n");
+		return false;
+	}
+
+	dt.damage = XDamageCreate(display, drawable, XDamageReportNonEmpty);
+	dt.parts = XFixesCreateRegion(display, nullptr, 0);
+	return true;
+}
+
+void destroyDamageTracker(DamageTracker& dt) {
+	if (!dt.damage) {
+		return;
+	}
+
+	XFixesDestroyRegion(dt.display, dt.parts);
+	XDamageDestroy(dt.display, dt.damage);
+	dt.damage = 0;
+}
+
+// Returns true if `ev` was a damage event for `dt`. The owner of the connection has
+// to feed every event it reads through here.
+bool handleDamageEvent(DamageTracker& dt, const XEvent& ev) {
+	// several trackers can share a connection
+	if (dt.damage && ev.type == dt.eventBase + XDamageNotify
+		&& ((const XDamageNotifyEvent&)ev).damage == dt.damage) {
+		if (!dt.pending) {
+			dt.since = ChangeStamp{((const XDamageNotifyEvent&)ev).timestamp, std::chrono::steady_clock::now()};
+		}
+		dt.pending = true;
+		return true;
+	}
+	return false;
+}
+
+// Adds everything damaged since the last call to `out`, and when the first of
+// it happened to `stamp` if given. Must be called before capturing, so that
+// anything drawn during the capture is reported next time.
+void collectDamage(DamageTracker& dt, DirtyRegion& out, ChangeStamp* stamp = nullptr) {
+	// The server only sends one notify until the damage is subtracted, so
+	// no pending notify means nothing changed and we skip the round-trip.
+	if (!dt.pending) {
+		return;
+	}
+
+	XDamageSubtract(dt.display, dt.damage, None, dt.parts);
+
+	int n = 0;
+	XRectangle* rects = XFixesFetchRegion(dt.display, dt.parts, &n);
+	for (int i = 0; i < n; i++) {
+		out.add(Rect{rects[i].x, rects[i].y, rects[i].width, rects[i].height});
+	}
+	if (rects) {
+		XFree(rects);
+	}
+
+	if (stamp) {
+		mergeChangeStamp(*stamp, dt.since);
+	}
+	dt.pending = false;
+}
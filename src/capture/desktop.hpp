@@ -0,0 +1,698 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/extensions/Xcomposite.h>
+#include <X11/extensions/Xrender.h>
+
+#include "damage.hpp"
+#include "region.hpp"
+#include "shm.hpp"
+#include "source.hpp"
+#include "window.hpp"
+#include "xlib.hpp"
+
+// A top-level window the desktop is assembled from
+struct DesktopWindow {
+	Window window;
+	// outer bounds, border included, in root coordinates
+	Rect bounds;
+	int border;
+	bool viewable;
+	// the window's contents as kept by the server, None while unmapped
+	Pixmap pixmap;
+	Picture picture;
+	// PictOpOver for windows with an alpha channel, PictOpSrc otherwise
+	int op;
+	DamageTracker damage;
+	bool hasDamage;
+};
+
+// Assembles the desktop into a pixmap of its own from every top-level window
+// but one, so that a window covering the whole screen (clearview's overlay)
+// can still capture what lies under it instead of itself.
+//
+// Top-level windows are redirected with Composite, which makes the server
+// keep their contents in pixmaps of their own; redirection is automatic, so
+// the screen looks as before. Those pixmaps are composited with XRender,
+// bottom to top, over the wallpaper (_XROOTPMAP_ID, black if there is none).
+// Only what changed is composited again: the damage of every window, and
+// the old and new bounds of windows that were mapped, unmapped, moved,
+// resized or restacked. Shaped windows are drawn as their bounding box.
+//
+// Windows can go away at any time, so requests about them are made with
+// errors trapped on the compositor's connection only (see trapXErrors);
+// it runs on the capture thread while other threads keep using Xlib.
+class DesktopCompositor {
+public:
+	DesktopCompositor() = default;
+	DesktopCompositor(const DesktopCompositor&) = delete;
+	DesktopCompositor& operator=(const DesktopCompositor&) = delete;
+
+	~DesktopCompositor() {
+		close();
+	}
+
+	// Returns false, without side effects, if the server lacks any of the
+	// extensions needed
+	bool open(Display* display, Window exclude) {
+		int eventBase, errorBase;
+		int major = 0;
+		int minor = 2;
+		if (!XCompositeQueryExtension(display, &eventBase, &errorBase)
+			|| !XCompositeQueryVersion(display, &major, &minor)
+			|| (major == 0 && minor < 2)) {
+			fprintf(stderr, "[WARN] Desktop capture needs Composite 0.2 or newer\n");
+			return false;
+		}
+		if (!XDamageQueryExtension(display, &eventBase, &errorBase)
+			|| !XFixesQueryExtension(display, &eventBase, &errorBase)) {
+			fprintf(stderr, "[WARN] Desktop capture needs XDamage and XFixes\n");
+			return false;
+		}
+		if (!XRenderQueryExtension(display, &eventBase, &errorBase)) {
+			fprintf(stderr, "[WARN] Desktop capture needs XRender\n");
+			return false;
+		}
+
+		int screen = DefaultScreen(display);
+		rootVisual = DefaultVisual(display, screen);
+		rootDepth = DefaultDepth(display, screen);
+		format = XRenderFindVisualFormat(display, rootVisual);
+		if (!format) {
+			fprintf(stderr, "[WARN] Desktop capture: XRender doesn't know the root visual\n");
+			return false;
+		}
+
+		this->display = display;
+		this->exclude = exclude;
+		root = RootWindow(display, screen);
+		wallpaperAtoms[0] = XInternAtom(display, "_XROOTPMAP_ID", False);
+		wallpaperAtoms[1] = XInternAtom(display, "ESETROOT_PMAP_ID", False);
+
+		XCompositeRedirectSubwindows(display, root, CompositeRedirectAutomatic);
+		// the connection may listen to the root for other reasons already
+		selectMoreInput(display, root, SubstructureNotifyMask | PropertyChangeMask);
+
+		treeDirty = true;
+		backgroundDirty = true;
+		update();
+		// nothing was captured yet, whoever captures first takes everything
+		pending.clear();
+		pendingStamp = ChangeStamp{};
+
+		printf("[INFO] Assembling the desktop from %zu windows", windows.size());
+		if (exclude != None) {
+			printf(", leaving out 0x%lx", exclude);
+		}
+		printf("\n");
+		return true;
+	}
+
+	Display* connection() const {
+		return display;
+	}
+
+	Window excluded() const {
+		return exclude;
+	}
+
+	// Changes when the root window is resized, see update()
+	Pixmap pixmap() const {
+		return desktop;
+	}
+
+	Visual* visual() const {
+		return rootVisual;
+	}
+
+	int depth() const {
+		return rootDepth;
+	}
+
+	// Every event read from the connection goes through here; handling the
+	// same event more than once is harmless.
+	void handleEvent(const XEvent& ev) {
+		for (DesktopWindow& w : windows) {
+			if (w.hasDamage && handleDamageEvent(w.damage, ev)) {
+				return;
+			}
+		}
+
+		if (ev.type == PropertyNotify) {
+			if (ev.xproperty.window == root
+				&& (ev.xproperty.atom == wallpaperAtoms[0] || ev.xproperty.atom == wallpaperAtoms[1])) {
+				backgroundDirty = true;
+			}
+			return;
+		}
+
+		// for SubstructureNotify events this is the parent, i.e. the root
+		if (ev.xany.window != root) {
+			return;
+		}
+
+		switch (ev.type) {
+		case CreateNotify:
+		case DestroyNotify:
+		case MapNotify:
+		case UnmapNotify:
+		case ReparentNotify:
+		case ConfigureNotify:
+		case CirculateNotify:
+		case GravityNotify:
+			treeDirty = true;
+			break;
+		}
+	}
+
+	// Brings the desktop pixmap up to date with everything that happened
+	// since the last call. What changed is kept for takeDamage().
+	void update() {
+		DirtyRegion dirty;
+
+		int screen = DefaultScreen(display);
+		if (DisplayWidth(display, screen) != width || DisplayHeight(display, screen) != height) {
+			allocate(DisplayWidth(display, screen), DisplayHeight(display, screen));
+			dirty.add(Rect{0, 0, width, height});
+		}
+
+		if (backgroundDirty) {
+			backgroundDirty = false;
+			loadBackground();
+			dirty.add(Rect{0, 0, width, height});
+		}
+
+		if (treeDirty) {
+			treeDirty = false;
+			refreshTree(dirty);
+		}
+
+		bool damaged = false;
+		for (const DesktopWindow& w : windows) {
+			damaged = damaged || (w.hasDamage && w.damage.pending);
+		}
+		if (damaged) {
+			// windows can be destroyed before their DestroyNotify was read
+			trapXErrors(display);
+			for (DesktopWindow& w : windows) {
+				if (!w.hasDamage) {
+					continue;
+				}
+
+				// reported relative to the inside of the border
+				DirtyRegion inside;
+				collectDamage(w.damage, inside, &pendingStamp);
+				if (!w.viewable) {
+					continue;
+				}
+				for (const Rect& r : inside.rects()) {
+					dirty.add(Rect{r.x + w.bounds.x + w.border, r.y + w.bounds.y + w.border, r.width, r.height});
+				}
+			}
+			untrapXErrors(display);
+		}
+
+		dirty.clip(Rect{0, 0, width, height});
+		compose(dirty);
+		pending.add(dirty);
+	}
+
+	// Adds what was composited again since the last call to `out`, and
+	// when the first window damage among it was reported to `stamp`
+	void takeDamage(DirtyRegion& out, ChangeStamp& stamp) {
+		for (const Rect& r : pending.rects()) {
+			out.add(r);
+		}
+		pending.clear();
+		mergeChangeStamp(stamp, pendingStamp);
+		pendingStamp = ChangeStamp{};
+	}
+
+private:
+	void allocate(int w, int h) {
+		if (picture) {
+			XRenderFreePicture(display, picture);
+		}
+		if (desktop) {
+			XFreePixmap(display, desktop);
+		}
+
+		width = w;
+		height = h;
+		desktop = XCreatePixmap(display, root, width, height, rootDepth);
+		picture = XRenderCreatePicture(display, desktop, format, 0, nullptr);
+	}
+
+	// Looks the wallpaper up the way pseudo-transparent terminals do
+	void loadBackground() {
+		if (background) {
+			XRenderFreePicture(display, background);
+			background = None;
+		}
+
+		Pixmap wallpaper = None;
+		for (Atom prop : wallpaperAtoms) {
+			Atom type;
+			int fmt;
+			unsigned long count, after;
+			unsigned char* data = nullptr;
+			if (XGetWindowProperty(display, root, prop, 0, 1, False, XA_PIXMAP,
+					&type, &fmt, &count, &after, &data) == Success && data) {
+				if (type == XA_PIXMAP && fmt == 32 && count == 1) {
+					wallpaper = (Pixmap)*(unsigned long*)data;
+				}
+				XFree(data);
+			}
+			if (wallpaper != None) {
+				break;
+			}
+		}
+
+		if (wallpaper == None) {
+			return;
+		}
+
+		// the pixmap belongs to whoever set the wallpaper and may be gone
+		XRenderPictureAttributes pa{};
+		pa.repeat = RepeatNormal;
+		trapXErrors(display);
+		background = XRenderCreatePicture(display, wallpaper, format, CPRepeat, &pa);
+		if (untrapXErrors(display) > 0) {
+			background = None;
+		}
+	}
+
+	// Matches `windows` with the children of the root, and adds to `dirty`
+	// whatever the differences uncovered or covered
+	void refreshTree(DirtyRegion& dirty) {
+		Window rootRet, parent;
+		Window* children = nullptr;
+		unsigned int n = 0;
+		if (!XQueryTree(display, root, &rootRet, &parent, &children, &n)) {
+			return;
+		}
+
+		std::vector<DesktopWindow> next;
+		// position in `windows` of every window of `next` that was known
+		std::vector<std::size_t> previous;
+
+		trapXErrors(display);
+		for (unsigned int i = 0; i < n; i++) {
+			if (children[i] == exclude) {
+				continue;
+			}
+
+			DesktopWindow w{};
+			w.window = children[i];
+			std::size_t index = windows.size();
+			for (std::size_t j = 0; j < windows.size(); j++) {
+				if (windows[j].window == children[i]) {
+					index = j;
+					w = windows[j];
+					windows[j].window = None;
+					break;
+				}
+			}
+			bool known = index != windows.size();
+
+			XWindowAttributes attrs;
+			if (!XGetWindowAttributes(display, w.window, &attrs) || attrs.c_class == InputOnly) {
+				if (known && w.viewable) {
+					dirty.add(w.bounds);
+				}
+				release(w);
+				continue;
+			}
+
+			Rect bounds{attrs.x, attrs.y, attrs.width + 2 * attrs.border_width, attrs.height + 2 * attrs.border_width};
+			bool viewable = attrs.map_state == IsViewable;
+
+			if (!known || bounds != w.bounds || viewable != w.viewable) {
+				if (known && w.viewable) {
+					dirty.add(w.bounds);
+				}
+				if (viewable) {
+					dirty.add(bounds);
+				}
+				// the server allocates a new pixmap on every map and resize
+				releasePixmap(w);
+			}
+
+			w.bounds = bounds;
+			w.border = attrs.border_width;
+			w.viewable = viewable;
+
+			if (viewable && w.pixmap == None) {
+				attach(w, attrs.visual);
+			}
+			if (!w.hasDamage) {
+				w.hasDamage = initDamageTracker(w.damage, display, w.window);
+			}
+
+			next.push_back(w);
+			previous.push_back(index);
+		}
+		if (children) {
+			XFree(children);
+		}
+
+		// whatever wasn't found again was destroyed or reparented
+		for (DesktopWindow& w : windows) {
+			if (w.window == None) {
+				continue;
+			}
+			if (w.viewable) {
+				dirty.add(w.bounds);
+			}
+			release(w);
+		}
+		untrapXErrors(display);
+
+		// Windows that were known keep their stacking order unless restacked.
+		// Of any two that swapped, at least one lands somewhere else than
+		// it would in the old order, and its bounds cover where they overlap.
+		std::vector<std::size_t> order;
+		for (std::size_t index : previous) {
+			if (index != windows.size()) {
+				order.push_back(index);
+			}
+		}
+		std::vector<std::size_t> sorted = order;
+		std::sort(sorted.begin(), sorted.end());
+
+		std::size_t k = 0;
+		for (std::size_t i = 0; i < next.size(); i++) {
+			if (previous[i] == windows.size()) {
+				continue;
+			}
+			if (order[k] != sorted[k] && next[i].viewable) {
+				dirty.add(next[i].bounds);
+			}
+			k++;
+		}
+
+		windows = std::move(next);
+	}
+
+	// Names the window's current pixmap. Called with errors trapped.
+	void attach(DesktopWindow& w, Visual* visual) {
+		XRenderPictFormat* fmt = XRenderFindVisualFormat(display, visual);
+		if (!fmt) {
+			return;
+		}
+
+		w.pixmap = XCompositeNameWindowPixmap(display, w.window);
+		w.picture = XRenderCreatePicture(display, w.pixmap, fmt, 0, nullptr);
+		w.op = fmt->type == PictTypeDirect && fmt->direct.alphaMask ? PictOpOver : PictOpSrc;
+	}
+
+	void releasePixmap(DesktopWindow& w) {
+		if (w.picture) {
+			XRenderFreePicture(display, w.picture);
+			w.picture = None;
+		}
+		if (w.pixmap) {
+			XFreePixmap(display, w.pixmap);
+			w.pixmap = None;
+		}
+	}
+
+	void release(DesktopWindow& w) {
+		releasePixmap(w);
+		if (w.hasDamage) {
+			destroyDamageTracker(w.damage);
+			w.hasDamage = false;
+		}
+	}
+
+	// Paints the wallpaper and every window over `dirty` only
+	void compose(const DirtyRegion& dirty) {
+		if (dirty.empty()) {
+			return;
+		}
+
+		std::vector<XRectangle> rects;
+		for (const Rect& r : dirty.rects()) {
+			rects.push_back(XRectangle{(short)r.x, (short)r.y, (unsigned short)r.width, (unsigned short)r.height});
+		}
+		XserverRegion clip = XFixesCreateRegion(display, rects.data(), (int)rects.size());
+		XFixesSetPictureClipRegion(display, picture, 0, 0, clip);
+
+		if (background) {
+			XRenderComposite(display, PictOpSrc, background, None, picture, 0, 0, 0, 0, 0, 0, width, height);
+		}
+		else {
+			XRenderColor black{0, 0, 0, 0xffff};
+			XRenderFillRectangle(display, PictOpSrc, picture, &black, 0, 0, width, height);
+		}
+
+		for (const DesktopWindow& w : windows) {
+			if (!w.viewable || !w.picture) {
+				continue;
+			}
+
+			bool hit = false;
+			for (const Rect& r : dirty.rects()) {
+				hit = hit || !r.intersect(w.bounds).empty();
+			}
+			if (hit) {
+				XRenderComposite(display, w.op, w.picture, None, picture,
+					0, 0, 0, 0, w.bounds.x, w.bounds.y, w.bounds.width, w.bounds.height);
+			}
+		}
+
+		XFixesSetPictureClipRegion(display, picture, 0, 0, None);
+		XFixesDestroyRegion(display, clip);
+	}
+
+	void close() {
+		if (!display) {
+			return;
+		}
+
+		// harmless if some windows are already gone
+		trapXErrors(display);
+		for (DesktopWindow& w : windows) {
+			release(w);
+		}
+		windows.clear();
+		if (background) {
+			XRenderFreePicture(display, background);
+		}
+		if (picture) {
+			XRenderFreePicture(display, picture);
+		}
+		if (desktop) {
+			XFreePixmap(display, desktop);
+		}
+		selectLessInput(display, root, SubstructureNotifyMask | PropertyChangeMask);
+		XCompositeUnredirectSubwindows(display, root, CompositeRedirectAutomatic);
+		untrapXErrors(display);
+
+		display = nullptr;
+	}
+
+	Display* display = nullptr;
+	Window root = None;
+	Window exclude = None;
+	Visual* rootVisual = nullptr;
+	int rootDepth = 0;
+	XRenderPictFormat* format = nullptr;
+	Atom wallpaperAtoms[2]{};
+
+	Pixmap desktop = None;
+	Picture picture = None;
+	Picture background = None;
+	int width = 0;
+	int height = 0;
+
+	// bottom to top
+	std::vector<DesktopWindow> windows;
+	bool treeDirty = false;
+	bool backgroundDirty = false;
+	// composited again but not taken yet
+	DirtyRegion pending;
+	ChangeStamp pendingStamp;
+};
+
+static std::mutex desktopCompositorMutex;
+static std::vector<std::weak_ptr<DesktopCompositor>>& desktopCompositors = *new std::vector<std::weak_ptr<DesktopCompositor>>();
+
+// The sources of every output on a connection share one compositor, so the
+// desktop is only assembled once however many monitors there are
+std::shared_ptr<DesktopCompositor> acquireDesktopCompositor(Display* display, Window exclude) {
+	std::lock_guard<std::mutex> lock(desktopCompositorMutex);
+
+	desktopCompositors.erase(std::remove_if(desktopCompositors.begin(), desktopCompositors.end(),
+		[](const std::weak_ptr<DesktopCompositor>& dc) { return dc.expired(); }), desktopCompositors.end());
+
+	for (const auto& weak : desktopCompositors) {
+		std::shared_ptr<DesktopCompositor> dc = weak.lock();
+		if (dc && dc->connection() == display && dc->excluded() == exclude) {
+			return dc;
+		}
+	}
+
+	auto dc = std::make_shared<DesktopCompositor>();
+	if (!dc->open(display, exclude)) {
+		return nullptr;
+	}
+	desktopCompositors.push_back(dc);
+	return dc;
+}
+
+// Captures the desktop as assembled by a DesktopCompositor, i.e. the screen
+// without one window, normally clearview's own overlay.
+//
+// Configured as "desktop[:ID]", ID being the window left out. Unlike the
+// standalone backends it captures any area of the screen like the regular
+// ones, and knows what changed from the compositor.
+class DesktopSource : public CaptureSource {
+public:
+	explicit DesktopSource(const std::string& spec) : spec(spec) {}
+
+	~DesktopSource() override {
+		destroyScaledCapture(scaled);
+		if (opened) {
+			destroyShmCapture(cap);
+		}
+	}
+
+	const char* name() const override {
+		return "desktop";
+	}
+
+	bool open(Display* display, const Rect& area) override {
+		std::size_t colon = spec.find(':');
+		Window exclude = colon == std::string::npos
+			? None
+			: (Window)std::strtoul(spec.c_str() + colon + 1, nullptr, 0);
+
+		std::shared_ptr<DesktopCompositor> dc = acquireDesktopCompositor(display, exclude);
+		if (!dc) {
+			return false;
+		}
+		if (!initShmCapture(cap, display, dc->pixmap(), dc->visual(), dc->depth(), area)) {
+			return false;
+		}
+
+		compositor = std::move(dc);
+		bounds = area;
+		opened = true;
+		return true;
+	}
+
+	ImageView image() const override {
+		if (scaleDivisor > 1) {
+			return scaledImage(scaled);
+		}
+		return ImageView{
+			(const std::uint8_t*)cap.image->data,
+			cap.width,
+			cap.height,
+			cap.image->bytes_per_line,
+			cap.format
+		};
+	}
+
+	bool setDivisor(int divisor) override {
+		if (divisor == scaleDivisor && (divisor == 1 || scaledPixmap == compositor->pixmap())) {
+			return true;
+		}
+
+		destroyScaledCapture(scaled);
+		scaleDivisor = 1;
+		if (divisor > 1 && !initScaledCapture(scaled, cap.display, compositor->pixmap(),
+				compositor->visual(), compositor->depth(), bounds, divisor)) {
+			return false;
+		}
+		scaleDivisor = divisor;
+		scaledPixmap = compositor->pixmap();
+		return true;
+	}
+
+	// The first source to ask takes the damage of the whole desktop, which
+	// is what the caller wants anyway
+	bool pollDamage(DirtyRegion& out) override {
+		compositor->update();
+		stamp = ChangeStamp{};
+		compositor->takeDamage(out, stamp);
+		return true;
+	}
+
+	ChangeStamp damageStamp() const override {
+		return stamp;
+	}
+
+	void handleEvent(const XEvent& ev) override {
+		compositor->handleEvent(ev);
+	}
+
+protected:
+	bool doGrab() override {
+		// also called without pollDamage, e.g. for the first frame
+		compositor->update();
+		if (scaleDivisor > 1 && followPixmap()) {
+			return captureScaled(scaled, {bounds});
+		}
+		cap.drawable = compositor->pixmap();
+		return capture(cap);
+	}
+
+	bool doGrabRect(const Rect& r) override {
+		if (scaleDivisor > 1 && followPixmap()) {
+			return captureScaled(scaled, {r});
+		}
+		cap.drawable = compositor->pixmap();
+		if (!cap.scratch && !scratchFailed) {
+			scratchFailed = !attachShmScratch(cap, (std::size_t)cap.image->bytes_per_line * cap.height / 2);
+		}
+		return captureRect(cap, r);
+	}
+
+	bool doGrabRects(const std::vector<Rect>& rects) override {
+		if (scaleDivisor > 1 && followPixmap()) {
+			return captureScaled(scaled, rects);
+		}
+#ifdef CAPTURE_SHM_FD
+		cap.drawable = compositor->pixmap();
+		if (!cap.scratch && !scratchFailed) {
+			scratchFailed = !attachShmScratch(cap, (std::size_t)cap.image->bytes_per_line * cap.height / 2);
+		}
+		return captureRects(cap, rects);
+#else
+		return CaptureSource::doGrabRects(rects);
+#endif
+	}
+
+private:
+	// Follows the compositor when it reallocates its pixmap on a resize.
+	// Drops back to full resolution if it can't.
+	bool followPixmap() {
+		if (scaledPixmap != compositor->pixmap() && !setDivisor(scaleDivisor)) {
+			fprintf(stderr, "[WARN] Lost the downscaled desktop capture\n");
+			return false;
+		}
+		return true;
+	}
+
+	std::string spec;
+	std::shared_ptr<DesktopCompositor> compositor;
+	ShmCapture cap{};
+	bool opened = false;
+	bool scratchFailed = false;
+	ScaledCapture scaled{};
+	// what `scaled` reads from
+	Pixmap scaledPixmap = None;
+	// of the last pollDamage
+	ChangeStamp stamp{};
+};
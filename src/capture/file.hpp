@@ -0,0 +1,194 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <X11/Xlib.h>
+
+#include "region.hpp"
+#include "source.hpp"
+#include "synthetic.hpp"
+
+// Reads a binary PPM (P6, 8 bits per channel) into 32bpp BGRA
+bool loadPPM(const std::string& path, int& width, int& height, std::vector<std::uint8_t>& out) {
+	std::ifstream file(path, std::ios::binary);
+	if (!file.is_open()) {
+		return false;
+	}
+
+	std::string magic;
+	int maxval;
+	file >> magic >> width >> height >> maxval;
+	file.get();
+	if (!file || magic != "P6" || maxval != 255 || width <= 0 || height <= 0) {
+		return false;
+	}
+
+	std::vector<std::uint8_t> rgb((std::size_t)width * height * 3);
+	if (!file.read((char*)rgb.data(), rgb.size())) {
+		return false;
+	}
+
+	out.resize((std::size_t)width * height * 4);
+	for (std::size_t i = 0, j = 0; i < rgb.size(); i += 3, j += 4) {
+		out[j + 0] = rgb[i + 2];
+		out[j + 1] = rgb[i + 1];
+		out[j + 2] = rgb[i + 0];
+		out[j + 3] = 0xff;
+	}
+	return true;
+}
+
+// Reads a file of tightly packed 32bpp BGRA rows
+bool loadRaw(const std::string& path, int width, int height, std::vector<std::uint8_t>& out) {
+	std::ifstream file(path, std::ios::binary);
+	if (!file.is_open()) {
+		return false;
+	}
+
+	out.resize((std::size_t)width * height * 4);
+	return (bool)file.read((char*)out.data(), out.size());
+}
+
+// Replays recorded frames instead of capturing anything.
+//
+// Configured as "file:PATH" or "file:PATH:WxH", where PATH is a single frame
+// or a directory of frames played in name order, over and over. Frames are
+// binary PPMs, or raw BGRA dumps when a size is given. Everything is loaded
+// up front, and what changed between consecutive frames is worked out in
+// SYNTHETIC_TILE squares, so replaying costs no disk I/O.
+class FileSource : public CaptureSource {
+public:
+	explicit FileSource(const std::string& spec) {
+		std::size_t prefix = spec.find(':');
+		std::string rest = prefix == std::string::npos ? "" : spec.substr(prefix + 1);
+
+		std::size_t colon = rest.rfind(':');
+		if (colon != std::string::npos && parseSize(rest.substr(colon + 1), rawWidth, rawHeight)) {
+			rest = rest.substr(0, colon);
+			raw = true;
+		}
+		path = rest;
+	}
+
+	const char* name() const override {
+		return "file";
+	}
+
+	// Always uses the size of the recorded frames; `display` and `area` are
+	// ignored
+	bool open(Display* display, const Rect& area) override {
+		(void)display;
+		(void)area;
+
+		std::vector<std::string> files;
+		std::error_code ec;
+		if (std::filesystem::is_directory(path, ec)) {
+			for (const auto& entry : std::filesystem::directory_iterator(path, ec)) {
+				if (entry.is_regular_file()) {
+					files.push_back(entry.path().string());
+				}
+			}
+			std::sort(files.begin(), files.end());
+		}
+		else {
+			files.push_back(path);
+		}
+
+		for (const std::string& f : files) {
+			std::vector<std::uint8_t> pixels;
+			int w = rawWidth;
+			int h = rawHeight;
+			bool ok = raw ? loadRaw(f, w, h, pixels) : loadPPM(f, w, h, pixels);
+			if (!ok) {
+				fprintf(stderr, "[ERROR] Couldn't read frame '%s'\n", f.c_str());
+				return false;
+			}
+
+			if (!frames.empty() && (w != bounds.width || h != bounds.height)) {
+				fprintf(stderr, "[ERROR] Frame '%s' is %dx%d, expected %dx%d\n",
+					f.c_str(), w, h, bounds.width, bounds.height);
+				return false;
+			}
+
+			bounds = Rect{0, 0, w, h};
+			frames.push_back(std::move(pixels));
+		}
+
+		if (frames.empty()) {
+			fprintf(stderr, "[ERROR] No frames found at '%s'\n", path.c_str());
+			return false;
+		}
+
+		for (std::size_t i = 0; i < frames.size(); i++) {
+			changes.push_back(diff(frames[(i + frames.size() - 1) % frames.size()], frames[i]));
+		}
+
+		printf("[INFO] Replaying %zu frames of %dx%d from '%s'\n",
+			frames.size(), bounds.width, bounds.height, path.c_str());
+		return true;
+	}
+
+	ImageView image() const override {
+		return ImageView{frames[current].data(), bounds.width, bounds.height, bounds.width * 4};
+	}
+
+	bool pollDamage(DirtyRegion& out) override {
+		damageDriven = true;
+		current = (current + 1) % frames.size();
+		out.add(changes[current]);
+		return true;
+	}
+
+protected:
+	bool doGrab() override {
+		// see SyntheticSource::doGrab
+		if (!damageDriven) {
+			current = (current + 1) % frames.size();
+		}
+		return true;
+	}
+
+	bool doGrabRect(const Rect& r) override {
+		(void)r;
+		return true;
+	}
+
+private:
+	// Tiles that differ between two frames
+	DirtyRegion diff(const std::vector<std::uint8_t>& a, const std::vector<std::uint8_t>& b) const {
+		DirtyRegion region;
+		int stride = bounds.width * 4;
+
+		for (int ty = 0; ty < bounds.height; ty += SYNTHETIC_TILE) {
+			for (int tx = 0; tx < bounds.width; tx += SYNTHETIC_TILE) {
+				Rect t = Rect{tx, ty, SYNTHETIC_TILE, SYNTHETIC_TILE}.intersect(bounds);
+
+				for (int y = t.y; y < t.bottom(); y++) {
+					std::size_t off = (std::size_t)y * stride + (std::size_t)t.x * 4;
+					if (std::memcmp(a.data() + off, b.data() + off, (std::size_t)t.width * 4) != 0) {
+						region.add(t);
+						break;
+					}
+				}
+			}
+		}
+		return region;
+	}
+
+	std::string path;
+	bool raw = false;
+	int rawWidth = 0;
+	int rawHeight = 0;
+
+	std::vector<std::vector<std::uint8_t>> frames;
+	std::vector<DirtyRegion> changes;
+	std::size_t current = 0;
+	bool damageDriven = false;
+};
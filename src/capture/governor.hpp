@@ -0,0 +1,79 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+// Rate live capture drops to when nothing happens, in Hz
+const float GOVERNOR_IDLE_RATE = 2.0f;
+// Highest rate while the window isn't focused, in Hz
+const float GOVERNOR_UNFOCUSED_RATE = 15.0f;
+// After a burst of activity the rate halves every this many seconds, until
+// the measured damage rate takes over
+const float GOVERNOR_HALF_LIFE = 0.25f;
+// How long the damage rate is averaged over, in seconds
+const float GOVERNOR_DAMAGE_WINDOW = 0.5f;
+// Content that changes f times a second is captured up to this many times f
+const float GOVERNOR_OVERSAMPLE = 2.0f;
+
+// What the render loop knows that the capture thread doesn't
+struct GovernorSignals {
+	// the camera is panning or zooming, so the visible area keeps changing
+	bool animating;
+	bool focused;
+};
+
+// Picks the rate of each live capture tick.
+//
+// Activity after a quiet spell (damage, or the camera starting to move)
+// jumps straight to the highest rate. From there the rate decays towards a
+// multiple of how often the content actually changes, and down to a trickle
+// once it stops.
+struct RateGovernor {
+	float maxRate;
+	float rate;
+	// smoothed number of ticks per second that found damage
+	float damageRate;
+	// seconds since the last burst of activity
+	float sinceBurst;
+	// seconds since the last tick that found damage
+	float sinceDamage;
+};
+
+void initRateGovernor(RateGovernor& g, float maxRate) {
+	g = RateGovernor{};
+	g.maxRate = maxRate;
+	g.rate = maxRate;
+	g.damageRate = 0.0f;
+	g.sinceBurst = 0.0f;
+	g.sinceDamage = 0.0f;
+}
+
+// Called after every tick with the seconds since the previous one and
+// whether this one found damage (callers that can't tell pass true).
+// Returns the rate for the next tick.
+float updateRateGovernor(RateGovernor& g, float dt, bool damaged, const GovernorSignals& signals) {
+	dt = std::max(dt, 1e-4f);
+
+	float alpha = 1.0f - std::exp(-dt / GOVERNOR_DAMAGE_WINDOW);
+	g.damageRate += ((damaged ? 1.0f / dt : 0.0f) - g.damageRate) * alpha;
+
+	g.sinceBurst += dt;
+	g.sinceDamage += dt;
+
+	if (signals.animating || (damaged && g.sinceDamage - dt >= GOVERNOR_HALF_LIFE)) {
+		g.sinceBurst = 0.0f;
+	}
+	if (damaged) {
+		g.sinceDamage = 0.0f;
+	}
+
+	float burst = g.maxRate * std::exp2(-g.sinceBurst / GOVERNOR_HALF_LIFE);
+	float rate = std::max(burst, g.damageRate * GOVERNOR_OVERSAMPLE);
+
+	if (!signals.focused) {
+		rate = std::min(rate, GOVERNOR_UNFOCUSED_RATE);
+	}
+
+	g.rate = std::clamp(rate, std::min(GOVERNOR_IDLE_RATE, g.maxRate), g.maxRate);
+	return g.rate;
+}
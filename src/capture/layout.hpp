@@ -0,0 +1,14 @@
+#pragma once
+
+#include "region.hpp"
+
+// A monitor, and where it sits in the root window (on Wayland, in the
+// compositor's global space). Rotated CRTCs already report their rotated
+// size, and the root window holds their pixels in the orientation they are
+// shown in, so captures of `bounds` never need to be rotated.
+struct Output {
+	unsigned long id;
+	Rect bounds;
+
+	bool operator==(const Output& o) const = default;
+};
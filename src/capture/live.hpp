@@ -0,0 +1,871 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "governor.hpp"
+#include "outputs.hpp"
+#include "region.hpp"
+#include "source.hpp"
+#include "tile_hash.hpp"
+#include "tiles.hpp"
+#include "triple_buffer.hpp"
+
+#ifdef CAPTURE_XDAMAGE
+#include "damage.hpp"
+#endif
+
+#ifdef CAPTURE_XPRESENT
+#include "present.hpp"
+#endif
+
+// Default delay between a vblank and the capture that follows it, in
+// milliseconds. Compositors flip at the vblank; capturing a little after
+// it catches the new frame whole instead of racing the flip.
+const float DEFAULT_CAPTURE_PHASE_MS = 1.0f;
+// Consecutive failed ticks after which every capture source is reopened
+const int CAPTURE_REOPEN_FAILURES = 3;
+// Longest wait between retries of a failed capture, in milliseconds
+const int CAPTURE_MAX_RETRY_MS = 500;
+
+// One updated rectangle of a Frame, always inside a single output. Its pixels
+// are rows of Frame::format, `stride` bytes apart, starting at `offset` in
+// Frame::pixels.
+struct Patch {
+	Rect rect;
+	std::size_t output;
+	std::size_t offset;
+	int stride;
+};
+
+// What changed on screen since the previous frame, handed from the capture
+// thread to the render loop. Only the patches carry pixels; everything else
+// is unchanged.
+struct Frame {
+	// size of the root window
+	int width = 0;
+	int height = 0;
+	// output layout the patches refer to
+	std::vector<Output> outputs;
+	std::vector<Patch> patches;
+	std::vector<std::uint8_t> pixels;
+	// always one of the formats textureFormat() returns, whatever the
+	// sources capture in
+	PixelFormat format = PixelFormat::BGRA8888;
+	// when each part of the screen was last captured, patches included
+	TileClock tiles;
+	// patches are at 1/divisor of the screen's resolution, and so are their
+	// rectangles (see Rect::scaledDown); the tiles are not
+	int divisor = 1;
+	// when the oldest pixels among the patches were captured, and when the
+	// frame was converted and ready to be handed over
+	std::chrono::steady_clock::time_point captured;
+	std::chrono::steady_clock::time_point converted;
+	// when the oldest change among the patches was reported, if damage
+	// told; pixels may have changed some time before they were captured
+	ChangeStamp change;
+	std::uint64_t sequence = 0;
+};
+
+struct LiveStats {
+	std::uint64_t captured = 0;
+	// published but overwritten before the render loop picked them up
+	std::uint64_t dropped = 0;
+	// took longer than a refresh at the highest rate
+	std::uint64_t late = 0;
+	// rate picked by the governor for the next tick, in Hz
+	float rate = 0.0f;
+	// CPU time spent by the capture thread
+	double cpuMs = 0.0;
+	// estimated CPU time a fixed-rate capture would have spent on top
+	double savedMs = 0.0;
+	// ticks where some capture failed, see LiveCapture
+	std::uint64_t failed = 0;
+};
+
+// Continuously captures the root window on a dedicated thread. The thread
+// owns its own X connection, so the render loop never waits on an X
+// round-trip; it only picks up whatever frame is newest.
+//
+// When XDamage (or the capture source itself) can tell what changed, only
+// the damaged rectangles are captured and handed over, and nothing at all is
+// published while the screen is idle. Servers without useful damage (Xvnc,
+// some nested servers) get the same from hashing: every tile captured is
+// hashed, and only tiles whose hash changed are handed over.
+// Either way, only the viewport set by the render loop and the area around
+// the pointer are captured at the full rate. The rest of the screen, which
+// panning may bring into view, is kept roughly current at PERIPHERY_RATE:
+// damage there waits until its tile is due, and without damage the tiles
+// captured the longest ago are refreshed a few at a time. Every tile keeps
+// the time it was last captured, handed over with each frame. Frames also
+// carry when their pixels were captured and converted, and when damage first
+// reported the change, so the render loop can tell how old what it shows is.
+//
+// The rate of each tick is picked by a RateGovernor, between the refresh
+// rate and a trickle when nothing changes. Between ticks the thread sleeps
+// on the X connection, so damage or the camera starting to move (see
+// setActivity) cuts a slow tick short. With the Present extension, ticks
+// are then held back until just after the next vblank (see
+// setCapturePhase), so they don't race the compositor's flip.
+//
+// When the render loop zooms out (see setScale), sources that can have the
+// server downscale to about the size shown, so fewer pixels cross the
+// connection and get uploaded.
+//
+// Every output has its own capture segment. When monitors are plugged,
+// unplugged or change mode, only the segments of the outputs that changed
+// are reallocated; the layout travels with each frame so the render loop
+// can do the same with its textures.
+//
+// Captures can fail, e.g. while the server switches modes and before the
+// change is reported. What failed is left out of the frame and captured in
+// full on the next tick, which waits longer after every failure, up to
+// CAPTURE_MAX_RETRY_MS. Sources that keep failing are reopened.
+class LiveCapture {
+public:
+	LiveCapture() = default;
+	LiveCapture(const LiveCapture&) = delete;
+	LiveCapture& operator=(const LiveCapture&) = delete;
+
+	~LiveCapture() {
+		stop();
+	}
+
+	// Returns false if the capture thread can't connect to the server
+	bool start(float refreshRate, const std::string& backend = "") {
+		display = XOpenDisplay(nullptr);
+		if (!display) {
+			fprintf(stderr, "[ERROR] Couldn't open display for live capture!\n");
+			return false;
+		}
+		this->backend = backend;
+
+		Window root = DefaultRootWindow(display);
+		initOutputTracker(outputTracker, display, root);
+
+		outputs = OutputCaptures{};
+		outputs.display = display;
+		initCaptureChain(outputs.chain, backend);
+
+		if (isStandaloneBackend(backend)) {
+			openStandaloneCaptures(outputs, backend);
+		}
+		else {
+			syncOutputCaptures(outputs, queryOutputs(display, root));
+		}
+
+		// the first frame would replace what is shown with nothing
+		if (outputs.sources.empty()) {
+			fprintf(stderr, "[ERROR] Live capture couldn't open any capture source!\n");
+			destroyOutputCaptures(outputs);
+			XCloseDisplay(display);
+			display = nullptr;
+			return false;
+		}
+
+#ifdef CAPTURE_XDAMAGE
+		if (!outputs.standalone) {
+			// Sources that know what changed don't need the root's damage,
+			// which would also wake the thread for every repaint of ours
+			DirtyRegion initial;
+			bool tracked = false;
+			for (auto& src : outputs.sources) {
+				tracked = src->pollDamage(initial) || tracked;
+			}
+			hasDamage = !tracked && initDamageTracker(damage, display, root);
+		}
+#endif
+		initRateGovernor(governor, std::max(refreshRate, 1.0f));
+#ifdef CAPTURE_XPRESENT
+		initVblankClock(vblank, display, root, governor.maxRate);
+#endif
+		period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(1.0 / governor.maxRate)
+		);
+		peripheryPeriod = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(1.0 / PERIPHERY_RATE)
+		);
+		rate.store(governor.maxRate, std::memory_order_relaxed);
+
+		wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (wakeFd < 0) {
+			fprintf(stderr, "[WARN] Couldn't create eventfd, activity will only be noticed on the next tick\n");
+		}
+
+		running.store(true);
+		thread = std::thread(&LiveCapture::run, this);
+		return true;
+	}
+
+	void stop() {
+		if (!thread.joinable()) {
+			return;
+		}
+
+		running.store(false);
+		wake();
+		thread.join();
+
+		if (wakeFd >= 0) {
+			close(wakeFd);
+			wakeFd = -1;
+		}
+#ifdef CAPTURE_XDAMAGE
+		destroyDamageTracker(damage);
+#endif
+#ifdef CAPTURE_XPRESENT
+		destroyVblankClock(vblank);
+#endif
+		destroyOutputCaptures(outputs);
+		XCloseDisplay(display);
+	}
+
+	// Called from the render loop. Returns true if a newer frame than the
+	// last one returned by frame() is available.
+	bool poll() {
+		return buffer.consume();
+	}
+
+	const Frame& frame() {
+		return buffer.front();
+	}
+
+	// Called from the render loop with the part of the screen that is
+	// currently visible (see viewportRect) and the part around the pointer
+	// (see cursorRect). Only those are captured at the full rate.
+	void setViewport(const Rect& r, const Rect& cursor = Rect{}) {
+		std::lock_guard<std::mutex> lock(viewportMutex);
+		viewport = r;
+		cursorArea = cursor;
+		hasViewport = true;
+	}
+
+	// Called from the render loop with the scale the screen is drawn at.
+	// Below 1/2, captures are downscaled by the largest power of two that
+	// still leaves a captured pixel per pixel drawn.
+	void setScale(float s) {
+		scale.store(s, std::memory_order_relaxed);
+	}
+
+	// Sets how long after a vblank captures happen, in milliseconds. Larger
+	// values leave the compositor more time to finish its flip, at the cost
+	// of latency. Only has an effect with the Present extension.
+	void setCapturePhase(float ms) {
+		phaseMs.store(std::max(ms, 0.0f), std::memory_order_relaxed);
+	}
+
+	// Called from the render loop with what it knows about the user's
+	// activity. The capture thread is woken right away when the camera starts
+	// moving or the window gains focus.
+	void setActivity(bool animating, bool focused) {
+		bool wasAnimating = this->animating.exchange(animating, std::memory_order_relaxed);
+		bool wasFocused = this->focused.exchange(focused, std::memory_order_relaxed);
+
+		if ((animating && !wasAnimating) || (focused && !wasFocused)) {
+			wake();
+		}
+	}
+
+	LiveStats stats() const {
+		return LiveStats{
+			captured.load(std::memory_order_relaxed),
+			dropped.load(std::memory_order_relaxed),
+			late.load(std::memory_order_relaxed),
+			rate.load(std::memory_order_relaxed),
+			cpuNs.load(std::memory_order_relaxed) / 1e6,
+			savedNs.load(std::memory_order_relaxed) / 1e6,
+			failedTicks.load(std::memory_order_relaxed)
+		};
+	}
+
+private:
+	void run() {
+		using clock = std::chrono::steady_clock;
+
+		clock::time_point tick = clock::now();
+		clock::time_point previousTick = tick;
+		std::uint64_t sequence = 0;
+		std::uint64_t ticks = 0;
+		// CPU time of a tick, averaged over the recent ones
+		double tickCpuNs = 0.0;
+
+		DirtyRegion region;
+		// rectangles of dropped frames that the next frame has to resend
+		DirtyRegion carry;
+		// damage outside the viewport, captured once it becomes visible
+		DirtyRegion stale;
+		// outputs whose segments were just (re)allocated and hold no pixels
+		DirtyRegion fresh;
+		// stamps of the oldest carried pixels
+		clock::time_point carryCaptured{};
+		ChangeStamp carryChange;
+
+		while (running.load(std::memory_order_relaxed)) {
+			std::int64_t cpuStart = threadCpuNs();
+			pumpEvents();
+
+			if (outputs.standalone) {
+				if (updateStandaloneCaptures(outputs)) {
+					fresh.add(outputs.outputs[0].bounds);
+				}
+			}
+			else if (outputTracker.dirty) {
+				outputTracker.dirty = false;
+				fresh.add(syncOutputCaptures(outputs, queryOutputs(display, DefaultRootWindow(display))));
+			}
+			fresh.add(retry);
+			retry.clear();
+
+			const Rect screen{0, 0, outputs.width, outputs.height};
+			if (!applyDivisor(captureDivisorFor(scale.load(std::memory_order_relaxed)))) {
+				// whatever segments hold is at the wrong resolution now
+				fresh.add(screen);
+			}
+			if (tiles.width != screen.width || tiles.height != screen.height) {
+				resetTileClock(tiles, screen.width, screen.height);
+				resetTileHashes(hashes, tiles);
+			}
+
+			// captured at the full rate
+			DirtyRegion fovea;
+			{
+				std::lock_guard<std::mutex> lock(viewportMutex);
+				if (hasViewport) {
+					fovea.add(viewport.intersect(screen));
+					fovea.add(cursorArea.intersect(screen));
+				}
+				else {
+					fovea.add(screen);
+				}
+			}
+
+			region.clear();
+			// the first frame is always complete, anything may have changed
+			// since the main thread's snapshot
+			bool changed = true;
+			bool tracked = false;
+			ChangeStamp change;
+			if (sequence == 0) {
+				region.add(screen);
+			}
+			else if (collectChanges(region, change)) {
+				tracked = true;
+				region.clip(screen);
+				region.add(stale);
+
+				stale = region;
+				region.clear();
+				for (const Rect& f : fovea.rects()) {
+					for (const Rect& r : stale.rects()) {
+						region.add(r.intersect(f));
+					}
+				}
+				for (const Rect& f : fovea.rects()) {
+					stale.subtract(f);
+				}
+
+				// damage elsewhere once its tiles are due
+				DirtyRegion due = dueTiles(tiles, stale, clock::now() - peripheryPeriod);
+				for (const Rect& r : due.rects()) {
+					region.add(r);
+					stale.subtract(r);
+				}
+				changed = !region.empty();
+			}
+			else {
+				// a refresh of the whole periphery spread over the ticks
+				// of one PERIPHERY_RATE period
+				region = fovea;
+				region.add(oldestTiles(tiles, fovea, PERIPHERY_RATE / std::max(governor.rate, PERIPHERY_RATE)));
+			}
+
+			// new segments are filled completely, visible or not
+			region.add(fresh);
+
+			DirtyRegion failed = captureOutputs(region);
+			if (!divisorHeld()) {
+				// a source dropped back to full resolution on its own
+				refusedDivisor = divisor;
+				applyDivisor(1);
+				fresh.add(screen);
+				region.add(screen);
+				failed = captureOutputs(region);
+			}
+			if (!failed.empty()) {
+				// whatever the failed sources hold isn't worth handing over
+				for (const Rect& r : failed.rects()) {
+					region.subtract(r);
+					fresh.subtract(r);
+				}
+				retry.add(failed);
+				captureFailed();
+			}
+			else if (failures > 0) {
+				printf("[INFO] Live capture works again after %d failed attempts\n", failures);
+				failures = 0;
+			}
+			clock::time_point capturedAt = clock::now();
+			stampTiles(tiles, region, tracked ? &stale : nullptr, capturedAt);
+
+			if (!tracked) {
+				// only hand over what the hashes say changed, except for new
+				// segments which hold nothing yet
+				DirtyRegion different = changedTiles(hashes, tiles, region, outputs.sources, divisor);
+				if (sequence > 0) {
+					region = different;
+					region.add(fresh);
+					changed = !region.empty();
+				}
+			}
+			fresh.clear();
+
+			// pixels for the carried rectangles are already up to date in
+			// the sources, they only need to be handed over again
+			bool carried = !carry.empty();
+			region.add(carry);
+			carry.clear();
+
+			if (!region.empty() && !outputs.sources.empty()) {
+				Frame& f = buffer.back();
+				fillFrame(f, region);
+				f.sequence = ++sequence;
+				f.captured = carried ? std::min(carryCaptured, capturedAt) : capturedAt;
+				f.change = change;
+				if (carried) {
+					mergeChangeStamp(f.change, carryChange);
+				}
+				f.converted = clock::now();
+
+				if (buffer.publish()) {
+					dropped.fetch_add(1, std::memory_order_relaxed);
+					const Frame& lost = buffer.back();
+					for (const Patch& p : lost.patches) {
+						carry.add(p.rect.scaledUp(lost.divisor));
+					}
+					carryCaptured = lost.captured;
+					carryChange = lost.change;
+				}
+				captured.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			clock::time_point now = clock::now();
+			if (now - tick > period) {
+				late.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			GovernorSignals signals{
+				animating.load(std::memory_order_relaxed),
+				focused.load(std::memory_order_relaxed)
+			};
+			float dt = std::chrono::duration<float>(tick - previousTick).count();
+			float next = updateRateGovernor(governor, dt, changed, signals);
+			rate.store(next, std::memory_order_relaxed);
+
+			// a fixed-rate capture would have run maxRate * dt ticks since
+			// the previous one instead of this single one
+			std::int64_t cpu = threadCpuNs() - cpuStart;
+			tickCpuNs += (cpu - tickCpuNs) * (ticks == 0 ? 1.0 : 0.1);
+			cpuNs.fetch_add(cpu, std::memory_order_relaxed);
+			if (ticks++ > 0) {
+				double skipped = std::max(0.0, (double)governor.maxRate * dt - 1.0);
+				savedNs.fetch_add((std::int64_t)(skipped * tickCpuNs), std::memory_order_relaxed);
+			}
+
+			// never faster than the refresh rate, and the rest of a slow
+			// tick is only waited out while nothing happens
+			clock::time_point idleUntil = tick + std::chrono::duration_cast<clock::duration>(
+				std::chrono::duration<double>(1.0 / next)
+			);
+			if (failures > 0) {
+				// give the server time, e.g. to finish switching modes,
+				// without being woken by what changes meanwhile
+				std::this_thread::sleep_until(tick + retryDelay());
+			}
+#ifdef CAPTURE_XPRESENT
+			if (vblank.available) {
+				waitForActivity(idleUntil);
+				waitForVblank();
+			}
+			else
+#endif
+			{
+				std::this_thread::sleep_until(tick + period);
+				waitForActivity(idleUntil);
+			}
+
+			previousTick = tick;
+			tick = clock::now();
+		}
+	}
+
+	// Sleeps until `until`, or until an event arrives on the capture
+	// connection or the render loop reports activity. Events read here are
+	// handled as usual; damage outside of the viewport wakes the thread too,
+	// the tick that follows finds out there is nothing to capture.
+	void waitForActivity(std::chrono::steady_clock::time_point until) {
+		using clock = std::chrono::steady_clock;
+
+		while (running.load(std::memory_order_relaxed)) {
+			if (XEventsQueued(display, QueuedAfterFlush) > 0 && pumpEvents()) {
+				return;
+			}
+
+			clock::time_point now = clock::now();
+			if (now >= until) {
+				return;
+			}
+
+			pollfd fds[2] = {
+				{ConnectionNumber(display), POLLIN, 0},
+				{wakeFd, POLLIN, 0}
+			};
+			int timeout = (int)std::chrono::ceil<std::chrono::milliseconds>(until - now).count();
+			if (::poll(fds, wakeFd >= 0 ? 2 : 1, timeout) < 0 && errno != EINTR) {
+				return;
+			}
+
+			if (wakeFd >= 0 && (fds[1].revents & POLLIN)) {
+				std::uint64_t count;
+				while (read(wakeFd, &count, sizeof(count)) > 0) {}
+				return;
+			}
+		}
+	}
+
+#ifdef CAPTURE_XPRESENT
+	// Waits for the first vblank after the one the previous tick followed,
+	// then for the phase offset. Gives up after a few refresh periods, e.g.
+	// while the display is off and vblanks stop.
+	void waitForVblank() {
+		using clock = std::chrono::steady_clock;
+
+		requestVblank(vblank, lastVblank);
+		clock::time_point timeout = clock::now() + period * 4;
+
+		while (running.load(std::memory_order_relaxed) && !vblank.fired) {
+			if (XEventsQueued(display, QueuedAfterFlush) > 0) {
+				pumpEvents();
+				continue;
+			}
+
+			clock::time_point now = clock::now();
+			if (now >= timeout) {
+				return;
+			}
+
+			pollfd fd{ConnectionNumber(display), POLLIN, 0};
+			int ms = (int)std::chrono::ceil<std::chrono::milliseconds>(timeout - now).count();
+			if (::poll(&fd, 1, ms) < 0 && errno != EINTR) {
+				return;
+			}
+		}
+
+		if (vblank.fired) {
+			lastVblank = vblank.msc;
+			std::this_thread::sleep_until(vblankDeadline(vblank, phaseMs.load(std::memory_order_relaxed)));
+		}
+	}
+#endif
+
+	void wake() {
+		if (wakeFd >= 0) {
+			std::uint64_t one = 1;
+			ssize_t written = write(wakeFd, &one, sizeof(one));
+			(void)written;
+		}
+	}
+
+	static std::int64_t threadCpuNs() {
+		timespec ts;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+		return (std::int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	}
+
+	// Reads every queued event on the capture connection. Returns true if
+	// there were any besides vblanks.
+	bool pumpEvents() {
+		bool activity = false;
+		while (XPending(display) > 0) {
+			XEvent ev;
+			XNextEvent(display, &ev);
+#ifdef CAPTURE_XPRESENT
+			if (handleVblankEvent(vblank, ev)) {
+				continue;
+			}
+#endif
+			activity = true;
+
+			if (handleOutputEvent(outputTracker, ev)) {
+				continue;
+			}
+#ifdef CAPTURE_XDAMAGE
+			if (handleDamageEvent(damage, ev)) {
+				continue;
+			}
+#endif
+			for (auto& src : outputs.sources) {
+				src->handleEvent(ev);
+			}
+		}
+		return activity;
+	}
+
+	// Called after a tick where some capture failed. Every few failures in
+	// a row the sources are reopened, in case they hold on to something the
+	// server dropped.
+	void captureFailed() {
+		failures++;
+		failedTicks.fetch_add(1, std::memory_order_relaxed);
+		if (failures % CAPTURE_REOPEN_FAILURES != 0) {
+			return;
+		}
+
+		fprintf(stderr, "[WARN] Live capture failed %d times in a row, reopening the capture sources\n", failures);
+		if (outputs.standalone) {
+			// keeps the old source if the backend won't open again
+			if (openStandaloneCaptures(outputs, backend)) {
+				retry.add(outputs.outputs[0].bounds);
+			}
+		}
+		else {
+			outputs.sources.clear();
+			outputs.outputs.clear();
+			retry.add(syncOutputCaptures(outputs, queryOutputs(display, DefaultRootWindow(display))));
+		}
+	}
+
+	// Doubles with every failure in a row, from one tick at the highest rate
+	std::chrono::steady_clock::duration retryDelay() const {
+		auto delay = period * (1 << std::min(failures - 1, 16));
+		return std::min<std::chrono::steady_clock::duration>(delay, std::chrono::milliseconds(CAPTURE_MAX_RETRY_MS));
+	}
+
+	// Has every source capture at 1/`want` of its resolution, or all at
+	// full resolution if any can't. A divisor refused once isn't asked for
+	// again. Returns false if the divisor changed, for any source.
+	bool applyDivisor(int want) {
+		if (want == refusedDivisor) {
+			want = 1;
+		}
+
+		bool unchanged = want == divisor;
+		for (auto& src : outputs.sources) {
+			unchanged = unchanged && src->divisor() == want;
+		}
+		if (unchanged) {
+			return true;
+		}
+
+		bool ok = true;
+		for (auto& src : outputs.sources) {
+			ok = src->setDivisor(want) && ok;
+		}
+		if (!ok) {
+			fprintf(stderr, "[INFO] Live capture can't downscale by %d, capturing at full resolution\n", want);
+			refusedDivisor = want;
+			want = 1;
+			for (auto& src : outputs.sources) {
+				src->setDivisor(1);
+			}
+		}
+		divisor = want;
+		return false;
+	}
+
+	bool divisorHeld() const {
+		for (auto& src : outputs.sources) {
+			if (src->divisor() != divisor) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Adds what changed since the last call to `out`, as reported by the
+	// sources themselves or else by XDamage, and when the first of it was
+	// reported to `stamp`. Returns false if neither can tell, and everything
+	// has to be captured.
+	bool collectChanges(DirtyRegion& out, ChangeStamp& stamp) {
+		bool tracked = false;
+		for (auto& src : outputs.sources) {
+			if (src->pollDamage(out)) {
+				tracked = true;
+				mergeChangeStamp(stamp, src->damageStamp());
+			}
+		}
+
+		if (tracked) {
+			return true;
+		}
+#ifdef CAPTURE_XDAMAGE
+		if (hasDamage) {
+			collectDamage(damage, out, &stamp);
+			return true;
+		}
+#endif
+		return false;
+	}
+
+	// Captures the part of `region` that lies on each output. Outputs that
+	// are mostly covered are captured in full, all of them started before
+	// waiting for any, so that sources capturing in the background overlap.
+	// Returns the areas of the sources that failed.
+	DirtyRegion captureOutputs(const DirtyRegion& region) {
+		DirtyRegion failed;
+		if (outputs.sources.empty()) {
+			// every source failed to reopen, a frame without outputs would
+			// blank the screen instead of keeping the last one
+			failed.add(Rect{0, 0, outputs.width, outputs.height});
+			return failed;
+		}
+		std::vector<CaptureSource*> full;
+
+		for (auto& src : outputs.sources) {
+			const Rect& bounds = src->area();
+
+			std::int64_t area = 0;
+			for (const Rect& r : region.rects()) {
+				area += r.intersect(bounds).area();
+			}
+
+			if (area == 0) {
+				continue;
+			}
+
+			if (area * 2 >= bounds.area()) {
+				if (src->beginGrab()) {
+					full.push_back(src.get());
+				}
+				else {
+					failed.add(bounds);
+				}
+				continue;
+			}
+
+			if (!src->grab(region)) {
+				failed.add(bounds);
+			}
+		}
+
+		for (CaptureSource* src : full) {
+			if (!src->finishGrab()) {
+				failed.add(src->area());
+			}
+		}
+		return failed;
+	}
+
+	// Copies the pixels under every rectangle of `region` out of the
+	// sources, splitting rectangles that span several outputs, and converts
+	// them to what the textures are uploaded as.
+	void fillFrame(Frame& f, const DirtyRegion& region) {
+		f.width = outputs.width;
+		f.height = outputs.height;
+		f.outputs = outputs.outputs;
+		f.format = outputs.sources.empty() ? PixelFormat::BGRA8888 : textureFormat(outputs.sources[0]->image().format);
+		f.tiles = tiles;
+		f.divisor = divisor;
+		f.patches.clear();
+
+		std::size_t size = 0;
+		for (const Rect& rect : region.rects()) {
+			for (std::size_t i = 0; i < outputs.sources.size(); i++) {
+				const Rect& area = outputs.sources[i]->area();
+				Rect r = rect.intersect(area);
+				if (r.empty()) {
+					continue;
+				}
+
+				r = r.scaledDown(divisor).intersect(area.scaledDown(divisor));
+				if (r.empty()) {
+					continue;
+				}
+
+				f.patches.push_back(Patch{r, i, size, r.width * 4});
+				size += (std::size_t)r.width * r.height * 4;
+			}
+		}
+		f.pixels.resize(size);
+
+		for (const Patch& p : f.patches) {
+			const CaptureSource& src = *outputs.sources[p.output];
+			ImageView img = src.image();
+			Rect area = src.area().scaledDown(divisor);
+			convertPixels(img.format,
+				img.data
+					+ (std::size_t)(p.rect.y - area.y) * img.stride
+					+ (std::size_t)(p.rect.x - area.x) * bytesPerPixel(img.format),
+				img.stride,
+				f.pixels.data() + p.offset,
+				p.stride,
+				p.rect.width,
+				p.rect.height
+			);
+		}
+	}
+
+	Display* display = nullptr;
+	std::string backend;
+	OutputTracker outputTracker{};
+	OutputCaptures outputs{};
+	// failed ticks in a row, and what they failed to capture
+	int failures = 0;
+	DirtyRegion retry;
+
+	std::mutex viewportMutex;
+	Rect viewport{};
+	Rect cursorArea{};
+	bool hasViewport = false;
+	TileClock tiles;
+	// only kept up to date while nothing reports damage
+	TileHashes hashes;
+
+#ifdef CAPTURE_XDAMAGE
+	DamageTracker damage{};
+	bool hasDamage = false;
+#endif
+	// one tick at the highest rate
+	std::chrono::steady_clock::duration period{};
+	// how long damage away from the viewport may wait
+	std::chrono::steady_clock::duration peripheryPeriod{};
+	RateGovernor governor{};
+	std::atomic<float> phaseMs{DEFAULT_CAPTURE_PHASE_MS};
+	std::atomic<float> scale{1.0f};
+	// what the sources capture at, see applyDivisor
+	int divisor = 1;
+	int refusedDivisor = 0;
+#ifdef CAPTURE_XPRESENT
+	VblankClock vblank{};
+	// vblank the last tick was captured after
+	std::uint64_t lastVblank = 0;
+#endif
+	std::atomic<bool> animating{false};
+	std::atomic<bool> focused{true};
+	// written to by the render loop to cut the capture thread's sleep short
+	int wakeFd = -1;
+
+	std::thread thread;
+	std::atomic<bool> running{false};
+	TripleBuffer<Frame> buffer;
+
+	std::atomic<std::uint64_t> captured{0};
+	std::atomic<std::uint64_t> dropped{0};
+	std::atomic<std::uint64_t> late{0};
+	std::atomic<float> rate{0.0f};
+	std::atomic<std::int64_t> cpuNs{0};
+	std::atomic<std::int64_t> savedNs{0};
+	std::atomic<std::uint64_t> failedTicks{0};
+};
@@ -0,0 +1,232 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <X11/Xlib.h>
+
+#ifdef CAPTURE_XRANDR
+#include <X11/extensions/Xrandr.h>
+#endif
+
+#include "region.hpp"
+#include "chain.hpp"
+#include "layout.hpp"
+#include "source.hpp"
+#include "xlib.hpp"
+
+// Returns every active output, or a single output covering the whole root if
+// XRandR is unavailable.
+std::vector<Output> queryOutputs(Display* display, Window root) {
+	std::vector<Output> outputs;
+
+#ifdef CAPTURE_XRANDR
+	int eventBase, errorBase;
+	if (XRRQueryExtension(display, &eventBase, &errorBase)) {
+		XRRScreenResources* res = XRRGetScreenResourcesCurrent(display, root);
+		if (res) {
+			for (int i = 0; i < res->ncrtc; i++) {
+				XRRCrtcInfo* info = XRRGetCrtcInfo(display, res, res->crtcs[i]);
+				if (!info) {
+					continue;
+				}
+
+				if (info->mode != None && info->noutput > 0) {
+					outputs.push_back(Output{
+						(unsigned long)res->crtcs[i],
+						Rect{info->x, info->y, (int)info->width, (int)info->height}
+					});
+				}
+
+				XRRFreeCrtcInfo(info);
+			}
+			XRRFreeScreenResources(res);
+		}
+	}
+#else
+	(void)root;
+#endif
+
+	if (outputs.empty()) {
+		int screen = DefaultScreen(display);
+		outputs.push_back(Output{
+			0,
+			Rect{0, 0, DisplayWidth(display, screen), DisplayHeight(display, screen)}
+		});
+	}
+
+	return outputs;
+}
+
+// Listens for monitors being plugged, unplugged, moved or changing mode.
+// Without XRandR, only changes to the size of the root window are noticed.
+struct OutputTracker {
+	Window root;
+	int eventBase;
+	// XRandR is there
+	bool available;
+	// set once a change event arrived, cleared by the owner after
+	// re-querying the outputs
+	bool dirty;
+};
+
+// Returns false if XRandR is unavailable, in which case only the root
+// window's size is followed
+bool initOutputTracker(OutputTracker& ot, Display* display, Window root) {
+	ot = OutputTracker{};
+	ot.root = root;
+	selectMoreInput(display, root, StructureNotifyMask);
+
+#ifdef CAPTURE_XRANDR
+	int errorBase;
+	if (!XRRQueryExtension(display, &ot.eventBase, &errorBase)) {
+		return false;
+	}
+
+	XRRSelectInput(display, root, RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask);
+	ot.available = true;
+	return true;
+#else
+	return false;
+#endif
+}
+
+// Returns true if `ev` was an XRandR event, or the root window changing size
+bool handleOutputEvent(OutputTracker& ot, XEvent& ev) {
+#ifdef CAPTURE_XRANDR
+	if (ot.available && (ev.type == ot.eventBase + RRScreenChangeNotify || ev.type == ot.eventBase + RRNotify)) {
+		// keeps DisplayWidth/DisplayHeight in sync with the new root size
+		XRRUpdateConfiguration(&ev);
+		ot.dirty = true;
+		return true;
+	}
+#endif
+
+	if (ev.type == ConfigureNotify && ev.xconfigure.window == ot.root) {
+		Screen* screen = ScreenOfDisplay(ev.xconfigure.display, DefaultScreen(ev.xconfigure.display));
+		if (ev.xconfigure.width != screen->width || ev.xconfigure.height != screen->height) {
+#ifdef CAPTURE_XRANDR
+			if (ot.available) {
+				XRRUpdateConfiguration(&ev);
+			}
+			else
+#endif
+			{
+				// what XRRUpdateConfiguration would do
+				screen->width = ev.xconfigure.width;
+				screen->height = ev.xconfigure.height;
+			}
+			ot.dirty = true;
+		}
+		return true;
+	}
+	return false;
+}
+
+// One capture source per output, all sharing a single connection.
+struct OutputCaptures {
+	Display* display;
+	CaptureChain chain;
+	std::vector<Output> outputs;
+	std::vector<std::unique_ptr<CaptureSource>> sources;
+	// size of the root window
+	int width;
+	int height;
+	// set when a standalone backend stands in for the screen, the layout
+	// then only changes when that backend changes size
+	bool standalone;
+};
+
+// Makes the layout of `oc` a single output covering its only source
+static void fitStandaloneLayout(OutputCaptures& oc) {
+	const Rect& area = oc.sources[0]->area();
+	oc.width = area.width;
+	oc.height = area.height;
+	oc.outputs = {Output{0, area}};
+}
+
+// Sets `oc` up with a single output backed by standalone backend `backend`,
+// sized however the backend likes. Returns false if it fails to open.
+bool openStandaloneCaptures(OutputCaptures& oc, const std::string& backend) {
+	std::unique_ptr<CaptureSource> src = createCaptureSource(backend);
+	if (!src || !src->open(oc.display, Rect{})) {
+		return false;
+	}
+
+	oc.standalone = true;
+	oc.sources.clear();
+	oc.sources.push_back(std::move(src));
+	fitStandaloneLayout(oc);
+	return true;
+}
+
+// Follows a standalone backend that changed size. Returns true if the layout
+// changed, in which case the whole new area has to be captured again.
+bool updateStandaloneCaptures(OutputCaptures& oc) {
+	if (!oc.standalone || oc.sources.empty() || !oc.sources[0]->updateArea()) {
+		return false;
+	}
+
+	fitStandaloneLayout(oc);
+	return true;
+}
+
+// Makes `oc` match `outputs`. Sources of outputs that kept their place and
+// size are left alone, everything else is (re)opened. Outputs that no
+// backend can capture are left out. Returns the areas whose sources are new
+// and hold no pixels yet.
+DirtyRegion syncOutputCaptures(OutputCaptures& oc, const std::vector<Output>& outputs) {
+	DirtyRegion fresh;
+
+	std::vector<Output> kept;
+	std::vector<std::unique_ptr<CaptureSource>> sources;
+	std::vector<std::unique_ptr<CaptureSource>> reused(outputs.size());
+
+	for (std::size_t j = 0; j < outputs.size(); j++) {
+		for (std::size_t i = 0; i < oc.outputs.size(); i++) {
+			if (oc.sources[i] && oc.outputs[i].bounds == outputs[j].bounds) {
+				reused[j] = std::move(oc.sources[i]);
+				break;
+			}
+		}
+	}
+
+	// sources that weren't reused are closed before opening the new ones,
+	// which can then take over their capture segments
+	oc.sources.clear();
+
+	for (std::size_t j = 0; j < outputs.size(); j++) {
+		const Output& out = outputs[j];
+		std::unique_ptr<CaptureSource> src = std::move(reused[j]);
+
+		if (!src) {
+			src = openCaptureSource(oc.chain, oc.display, out.bounds);
+			if (!src) {
+				fprintf(stderr, "[ERROR] No capture backend works for the output at %d,%d (%dx%d)\n",
+					out.bounds.x, out.bounds.y, out.bounds.width, out.bounds.height);
+				continue;
+			}
+			fresh.add(out.bounds);
+		}
+
+		kept.push_back(out);
+		sources.push_back(std::move(src));
+	}
+
+	int screen = DefaultScreen(oc.display);
+	oc.width = DisplayWidth(oc.display, screen);
+	oc.height = DisplayHeight(oc.display, screen);
+	oc.outputs = std::move(kept);
+	oc.sources = std::move(sources);
+
+	return fresh;
+}
+
+void destroyOutputCaptures(OutputCaptures& oc) {
+	oc.sources.clear();
+	oc.outputs.clear();
+	trimShmSegments(oc.display);
+}
@@ -0,0 +1,451 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef CAPTURE_X11
+#include <X11/Xlib.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PIXEL_FORMAT_X86
+#include <immintrin.h>
+#endif
+
+// Layout of captured pixels, named after the bits of a little-endian pixel
+// value from the highest down. The first two are what textures are
+// uploaded as; everything else is converted to one of them first (see
+// textureFormat).
+enum class PixelFormat {
+	// GL_RGBA8, uploaded as GL_BGRA / GL_UNSIGNED_BYTE
+	BGRA8888,
+	// GL_RGB10_A2, uploaded as GL_BGRA / GL_UNSIGNED_INT_2_10_10_10_REV
+	ARGB2101010,
+	// 24-bit depth in 32 bits per pixel, the padding byte is undefined
+	BGRX8888,
+	// 30-bit depth in 32 bits per pixel
+	XRGB2101010,
+	// 24 bits per pixel, bytes in B, G, R order
+	RGB888,
+	// 16 bits per pixel
+	RGB565,
+	Unknown,
+};
+
+int bytesPerPixel(PixelFormat format) {
+	switch (format) {
+	case PixelFormat::RGB888:
+		return 3;
+	case PixelFormat::RGB565:
+		return 2;
+	case PixelFormat::Unknown:
+		return 0;
+	default:
+		return 4;
+	}
+}
+
+// What `format` is converted to before it is uploaded
+PixelFormat textureFormat(PixelFormat format) {
+	switch (format) {
+	case PixelFormat::ARGB2101010:
+	case PixelFormat::XRGB2101010:
+		return PixelFormat::ARGB2101010;
+	default:
+		return PixelFormat::BGRA8888;
+	}
+}
+
+#ifdef CAPTURE_X11
+// Works out the layout of `image`'s pixels, or Unknown for the visuals that
+// aren't supported (pseudo-color, big-endian servers, odd channel orders)
+PixelFormat pixelFormatOf(const XImage* image) {
+	if (image->format != ZPixmap || image->byte_order != LSBFirst) {
+		return PixelFormat::Unknown;
+	}
+
+	unsigned long r = image->red_mask;
+	unsigned long g = image->green_mask;
+	unsigned long b = image->blue_mask;
+
+	if (image->bits_per_pixel == 32 && r == 0xff0000 && g == 0xff00 && b == 0xff) {
+		return image->depth == 32 ? PixelFormat::BGRA8888 : PixelFormat::BGRX8888;
+	}
+	if (image->bits_per_pixel == 32 && r == 0x3ff00000 && g == 0xffc00 && b == 0x3ff) {
+		return PixelFormat::XRGB2101010;
+	}
+	if (image->bits_per_pixel == 24 && r == 0xff0000 && g == 0xff00 && b == 0xff) {
+		return PixelFormat::RGB888;
+	}
+	if (image->bits_per_pixel == 16 && r == 0xf800 && g == 0x7e0 && b == 0x1f) {
+		return PixelFormat::RGB565;
+	}
+	return PixelFormat::Unknown;
+}
+#endif
+
+// Frames with fewer pixels than this are converted on the calling thread
+const std::int64_t CONVERT_PARALLEL_PIXELS = 1 << 20;
+// Fewest rows handed to a thread, and most threads used for one frame
+const int CONVERT_MIN_ROWS = 64;
+const int CONVERT_MAX_THREADS = 8;
+
+// A row kernel converts as many of the first `width` pixels of a row as it
+// can in whole vectors and returns how many that was; the scalar code does
+// the rest. `fill` is ORed into every output pixel to make it opaque.
+using ConvertRowKernel = int (*)(const std::uint8_t* src, std::uint8_t* dst, int width, std::uint32_t fill);
+
+static void convertRowScalar(PixelFormat format, const std::uint8_t* src, std::uint8_t* dst, int from, int width, std::uint32_t fill) {
+	for (int x = from; x < width; x++) {
+		std::uint32_t p = 0;
+		switch (format) {
+		case PixelFormat::RGB888:
+			p = src[x * 3] | (src[x * 3 + 1] << 8) | (src[x * 3 + 2] << 16);
+			break;
+		case PixelFormat::RGB565: {
+			std::uint16_t v;
+			std::memcpy(&v, src + x * 2, 2);
+			std::uint32_t r = v >> 11, g = (v >> 5) & 0x3f, b = v & 0x1f;
+			p = ((r << 3) | (r >> 2)) << 16 | ((g << 2) | (g >> 4)) << 8 | ((b << 3) | (b >> 2));
+			break;
+		}
+		default:
+			std::memcpy(&p, src + x * 4, 4);
+			break;
+		}
+		p |= fill;
+		std::memcpy(dst + x * 4, &p, 4);
+	}
+}
+
+#ifdef PIXEL_FORMAT_X86
+__attribute__((target("sse2")))
+static int fillRowSse2(const std::uint8_t* src, std::uint8_t* dst, int width, std::uint32_t fill) {
+	const __m128i f = _mm_set1_epi32((int)fill);
+	int x = 0;
+	for (; x + 4 <= width; x += 4) {
+		__m128i p = _mm_loadu_si128((const __m128i*)(src + x * 4));
+		_mm_storeu_si128((__m128i*)(dst + x * 4), _mm_or_si128(p, f));
+	}
+	return x;
+}
+
+__attribute__((target("avx2")))
+static int fillRowAvx2(const std::uint8_t* src, std::uint8_t* dst, int width, std::uint32_t fill) {
+	const __m256i f = _mm256_set1_epi32((int)fill);
+	int x = 0;
+	for (; x + 8 <= width; x += 8) {
+		__m256i p = _mm256_loadu_si256((const __m256i*)(src + x * 4));
+		_mm256_storeu_si256((__m256i*)(dst + x * 4), _mm256_or_si256(p, f));
+	}
+	return x;
+}
+
+// Channels are widened by repeating their top bits, so full scale stays
+// full scale: 5 bits abcde become abcdeabc.
+__attribute__((target("sse2")))
+static int rgb565RowSse2(const std::uint8_t* src, std::uint8_t* dst, int width, std::uint32_t fill) {
+	(void)fill;
+	const __m128i mask5 = _mm_set1_epi16(0x1f);
+	const __m128i mask6 = _mm_set1_epi16(0x3f);
+	const __m128i alpha = _mm_set1_epi16((short)0xff00);
+	int x = 0;
+	for (; x + 8 <= width; x += 8) {
+		__m128i p = _mm_loadu_si128((const __m128i*)(src + x * 2));
+		__m128i r = _mm_srli_epi16(p, 11);
+		__m128i g = _mm_and_si128(_mm_srli_epi16(p, 5), mask6);
+		__m128i b = _mm_and_si128(p, mask5);
+		r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+		g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+		b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+
+		// 16-bit lanes of B | G << 8 and R | A << 8, interleaved into BGRA
+		__m128i bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+		__m128i ra = _mm_or_si128(r, alpha);
+		_mm_storeu_si128((__m128i*)(dst + x * 4), _mm_unpacklo_epi16(bg, ra));
+		_mm_storeu_si128((__m128i*)(dst + x * 4 + 16), _mm_unpackhi_epi16(bg, ra));
+	}
+	return x;
+}
+
+__attribute__((target("avx2")))
+static int rgb565RowAvx2(const std::uint8_t* src, std::uint8_t* dst, int width, std::uint32_t fill) {
+	(void)fill;
+	const __m256i mask5 = _mm256_set1_epi16(0x1f);
+	const __m256i mask6 = _mm256_set1_epi16(0x3f);
+	const __m256i alpha = _mm256_set1_epi16((short)0xff00);
+	int x = 0;
+	for (; x + 16 <= width; x += 16) {
+		__m256i p = _mm256_loadu_si256((const __m256i*)(src + x * 2));
+		__m256i r = _mm256_srli_epi16(p, 11);
+		__m256i g = _mm256_and_si256(_mm256_srli_epi16(p, 5), mask6);
+		__m256i b = _mm256_and_si256(p, mask5);
+		r = _mm256_or_si256(_mm256_slli_epi16(r, 3), _mm256_srli_epi16(r, 2));
+		g = _mm256_or_si256(_mm256_slli_epi16(g, 2), _mm256_srli_epi16(g, 4));
+		b = _mm256_or_si256(_mm256_slli_epi16(b, 3), _mm256_srli_epi16(b, 2));
+
+		__m256i bg = _mm256_or_si256(b, _mm256_slli_epi16(g, 8));
+		__m256i ra = _mm256_or_si256(r, alpha);
+		// unpacking works within 128-bit lanes, which leaves pixels 0-3 and
+		// 8-11 in `lo` and 4-7 and 12-15 in `hi`
+		__m256i lo = _mm256_unpacklo_epi16(bg, ra);
+		__m256i hi = _mm256_unpackhi_epi16(bg, ra);
+		_mm256_storeu_si256((__m256i*)(dst + x * 4), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i*)(dst + x * 4 + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	return x;
+}
+
+// SSE2 has no byte shuffle, so 24-bit pixels need SSSE3 at least. Every
+// load reads 16 bytes for 4 pixels, so the last few are left to the
+// scalar code rather than reading past the row.
+__attribute__((target("ssse3")))
+static int rgb888RowSsse3(const std::uint8_t* src, std::uint8_t* dst, int width, std::uint32_t fill) {
+	const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	const __m128i f = _mm_set1_epi32((int)fill);
+	int x = 0;
+	for (; x + 6 <= width; x += 4) {
+		__m128i p = _mm_loadu_si128((const __m128i*)(src + x * 3));
+		_mm_storeu_si128((__m128i*)(dst + x * 4), _mm_or_si128(_mm_shuffle_epi8(p, shuffle), f));
+	}
+	return x;
+}
+
+__attribute__((target("avx2")))
+static int rgb888RowAvx2(const std::uint8_t* src, std::uint8_t* dst, int width, std::uint32_t fill) {
+	const __m256i shuffle = _mm256_setr_epi8(
+		0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+		0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1
+	);
+	const __m256i f = _mm256_set1_epi32((int)fill);
+	int x = 0;
+	for (; x + 10 <= width; x += 8) {
+		// pixels 0-3 in the low lane, 4-7 in the high one
+		__m256i p = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(src + x * 3))),
+			_mm_loadu_si128((const __m128i*)(src + x * 3 + 12)),
+			1
+		);
+		_mm256_storeu_si256((__m256i*)(dst + x * 4), _mm256_or_si256(_mm256_shuffle_epi8(p, shuffle), f));
+	}
+	return x;
+}
+
+// Picks the widest kernel the CPU runs, once per format
+static ConvertRowKernel convertRowKernel(PixelFormat format) {
+	static const bool avx2 = __builtin_cpu_supports("avx2");
+	static const bool ssse3 = __builtin_cpu_supports("ssse3");
+
+	switch (format) {
+	case PixelFormat::BGRX8888:
+	case PixelFormat::XRGB2101010:
+		return avx2 ? fillRowAvx2 : fillRowSse2;
+	case PixelFormat::RGB565:
+		return avx2 ? rgb565RowAvx2 : rgb565RowSse2;
+	case PixelFormat::RGB888:
+		return avx2 ? rgb888RowAvx2 : ssse3 ? rgb888RowSsse3 : nullptr;
+	default:
+		return nullptr;
+	}
+}
+#else
+static ConvertRowKernel convertRowKernel(PixelFormat format) {
+	(void)format;
+	return nullptr;
+}
+#endif
+
+// Bits set in every converted pixel, i.e. an opaque alpha
+static std::uint32_t opaqueBits(PixelFormat format) {
+	switch (format) {
+	case PixelFormat::BGRX8888:
+	case PixelFormat::RGB888:
+	case PixelFormat::RGB565:
+		return 0xff000000;
+	case PixelFormat::XRGB2101010:
+		return 0xc0000000;
+	default:
+		return 0;
+	}
+}
+
+// Threads converting the bands of large frames, started on first use and
+// kept until exit, so that live mode doesn't start and join threads for
+// every frame. One frame is converted at a time; callers finding the pool
+// busy (the capture and render threads both convert) do without it.
+class ConvertPool {
+public:
+	static ConvertPool& instance() {
+		static ConvertPool pool;
+		return pool;
+	}
+
+	ConvertPool(const ConvertPool&) = delete;
+	ConvertPool& operator=(const ConvertPool&) = delete;
+
+	~ConvertPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			running = false;
+			wake.notify_all();
+		}
+		for (auto& t : workers) {
+			t.join();
+		}
+	}
+
+	// Threads that can work on a job, the caller included
+	int threads() const {
+		return (int)workers.size() + 1;
+	}
+
+	// Calls `fn` with every index below `count`, spread over the pool and
+	// the calling thread. Returns false, without calling it, if the pool
+	// is busy with another job.
+	bool run(int count, const std::function<void(int)>& fn) {
+		std::unique_lock<std::mutex> busy(jobMutex, std::try_to_lock);
+		if (!busy.owns_lock()) {
+			return false;
+		}
+
+		std::uint64_t current;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job = &fn;
+			next = 0;
+			total = count;
+			remaining = count;
+			current = ++generation;
+			wake.notify_all();
+		}
+
+		work(fn, current);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [&] { return remaining == 0; });
+		job = nullptr;
+		return true;
+	}
+
+private:
+	ConvertPool() {
+		int count = std::min((int)std::max(1u, std::thread::hardware_concurrency()), CONVERT_MAX_THREADS);
+		for (int i = 1; i < count; i++) {
+			workers.emplace_back(&ConvertPool::loop, this);
+		}
+	}
+
+	void loop() {
+		std::uint64_t seen = 0;
+		while (true) {
+			const std::function<void(int)>* fn;
+			std::uint64_t current;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [&] { return !running || generation != seen; });
+				if (!running) {
+					return;
+				}
+				seen = generation;
+				current = generation;
+				fn = job;
+			}
+			if (fn) {
+				work(*fn, current);
+			}
+		}
+	}
+
+	// Takes indices of job `current` until there are none left, or another
+	// job replaced it
+	void work(const std::function<void(int)>& fn, std::uint64_t current) {
+		while (true) {
+			int i;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (generation != current || next >= total) {
+					return;
+				}
+				i = next++;
+			}
+
+			fn(i);
+
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--remaining == 0) {
+				done.notify_one();
+			}
+		}
+	}
+
+	std::vector<std::thread> workers;
+	std::mutex jobMutex;
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	const std::function<void(int)>* job = nullptr;
+	std::uint64_t generation = 0;
+	int next = 0;
+	int total = 0;
+	int remaining = 0;
+	bool running = true;
+};
+
+// Converts `width` x `height` pixels of `format` into textureFormat(format),
+// both sides `stride` bytes per row apart. Large frames are split into
+// bands of rows converted in parallel on the ConvertPool.
+void convertPixels(PixelFormat format,
+	const std::uint8_t* src, int srcStride,
+	std::uint8_t* dst, int dstStride,
+	int width, int height)
+{
+	if (width <= 0 || height <= 0) {
+		return;
+	}
+
+	auto convertRows = [=](int y0, int y1) {
+		if (format == textureFormat(format)) {
+			for (int y = y0; y < y1; y++) {
+				std::memcpy(dst + (std::size_t)y * dstStride, src + (std::size_t)y * srcStride, (std::size_t)width * 4);
+			}
+			return;
+		}
+
+		ConvertRowKernel kernel = convertRowKernel(format);
+		std::uint32_t fill = opaqueBits(format);
+		for (int y = y0; y < y1; y++) {
+			const std::uint8_t* s = src + (std::size_t)y * srcStride;
+			std::uint8_t* d = dst + (std::size_t)y * dstStride;
+			int done = kernel ? kernel(s, d, width, fill) : 0;
+			convertRowScalar(format, s, d, done, width, fill);
+		}
+	};
+
+	if ((std::int64_t)width * height < CONVERT_PARALLEL_PIXELS) {
+		convertRows(0, height);
+		return;
+	}
+
+	ConvertPool& pool = ConvertPool::instance();
+	int threads = std::min(pool.threads(), height / CONVERT_MIN_ROWS);
+	if (threads <= 1) {
+		convertRows(0, height);
+		return;
+	}
+
+	int band = (height + threads - 1) / threads;
+	int bands = (height + band - 1) / band;
+	bool pooled = pool.run(bands, [&](int i) {
+		convertRows(i * band, std::min(height, (i + 1) * band));
+	});
+	if (!pooled) {
+		convertRows(0, height);
+	}
+}
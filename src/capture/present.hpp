@@ -0,0 +1,119 @@
+#pragma once
+
+#include <X11/Xlib.h>
+#include <X11/extensions/Xpresent.h>
+
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+
+// Tells when the display refreshes, through PresentNotifyMSC on the root
+// window (the server follows the CRTC covering most of it).
+//
+// Every notification reports the vblank counter (MSC) and the time it
+// ticked (UST, microseconds of CLOCK_MONOTONIC), from which the refresh
+// period is estimated. Notifications are only asked for when a capture is
+// about to be scheduled, so an idle capture thread isn't woken every frame.
+struct VblankClock {
+	Display* display;
+	Window root;
+	bool available;
+	int opcode;
+	XID eventId;
+
+	// last vblank reported
+	std::uint64_t msc;
+	std::uint64_t ust;
+	// estimated time between vblanks, in microseconds
+	double period;
+
+	// serial of the notification waited for
+	std::uint32_t serial;
+	// set once that notification arrived
+	bool fired;
+};
+
+// Returns false if the server lacks the Present extension, in which case
+// captures are timed by the capture thread alone
+bool initVblankClock(VblankClock& vc, Display* display, Window root, float refreshRate) {
+	vc = VblankClock{};
+	vc.display = display;
+	vc.root = root;
+	vc.period = 1e6 / refreshRate;
+
+	int eventBase, errorBase;
+	if (!XPresentQueryExtension(display, &vc.opcode, &eventBase, &errorBase)) {
+		fprintf(stderr, "[WARN] Present is not available, live capture won't follow vblank\n");
+		return false;
+	}
+
+	vc.eventId = XPresentSelectInput(display, root, PresentCompleteNotifyMask);
+	vc.available = true;
+	return true;
+}
+
+void destroyVblankClock(VblankClock& vc) {
+	if (vc.available) {
+		XPresentFreeInput(vc.display, vc.root, vc.eventId);
+		vc.available = false;
+	}
+}
+
+static std::uint64_t monotonicMicros() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (std::uint64_t)ts.tv_sec * 1000000 + (std::uint64_t)ts.tv_nsec / 1000;
+}
+
+// Asks to be notified at the first vblank after now, but not before vblank
+// `after` + 1. Targets that already passed complete right away.
+void requestVblank(VblankClock& vc, std::uint64_t after) {
+	std::uint64_t target = after + 1;
+	if (vc.msc != 0) {
+		std::uint64_t now = monotonicMicros();
+		std::uint64_t elapsed = now > vc.ust ? (std::uint64_t)((now - vc.ust) / vc.period) : 0;
+		target = std::max(target, vc.msc + elapsed + 1);
+	}
+
+	XPresentNotifyMSC(vc.display, vc.root, ++vc.serial, target, 0, 0);
+	XFlush(vc.display);
+	vc.fired = false;
+}
+
+// Returns true if `ev` was a Present event. The owner of the connection has
+// to feed every event it reads through here.
+bool handleVblankEvent(VblankClock& vc, XEvent& ev) {
+	if (!vc.available || ev.type != GenericEvent || ev.xcookie.extension != vc.opcode) {
+		return false;
+	}
+	if (!XGetEventData(vc.display, &ev.xcookie)) {
+		return true;
+	}
+
+	if (ev.xcookie.evtype == PresentCompleteNotify) {
+		auto* notify = (XPresentCompleteNotifyEvent*)ev.xcookie.data;
+		if (notify->kind == PresentCompleteKindNotifyMSC && notify->msc > vc.msc) {
+			if (vc.msc != 0 && notify->ust > vc.ust) {
+				double measured = (double)(notify->ust - vc.ust) / (double)(notify->msc - vc.msc);
+				vc.period = vc.period * 0.9 + measured * 0.1;
+			}
+			vc.msc = notify->msc;
+			vc.ust = notify->ust;
+		}
+		if (notify->serial_number == vc.serial) {
+			vc.fired = true;
+		}
+	}
+
+	XFreeEventData(vc.display, &ev.xcookie);
+	return true;
+}
+
+// When the last reported vblank plus `phaseMs` falls on the steady clock
+std::chrono::steady_clock::time_point vblankDeadline(const VblankClock& vc, float phaseMs) {
+	std::int64_t delta = (std::int64_t)vc.ust + (std::int64_t)(phaseMs * 1000.0f) - (std::int64_t)monotonicMicros();
+	return std::chrono::steady_clock::now() + std::chrono::microseconds(delta);
+}
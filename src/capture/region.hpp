@@ -0,0 +1,191 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+struct Rect {
+	int x = 0;
+	int y = 0;
+	int width = 0;
+	int height = 0;
+
+	bool empty() const {
+		return width <= 0 || height <= 0;
+	}
+
+	std::int64_t area() const {
+		return empty() ? 0 : (std::int64_t)width * height;
+	}
+
+	int right() const {
+		return x + width;
+	}
+
+	int bottom() const {
+		return y + height;
+	}
+
+	Rect intersect(const Rect& o) const {
+		int x0 = std::max(x, o.x);
+		int y0 = std::max(y, o.y);
+		int x1 = std::min(right(), o.right());
+		int y1 = std::min(bottom(), o.bottom());
+		if (x1 <= x0 || y1 <= y0) {
+			return Rect{};
+		}
+		return Rect{x0, y0, x1 - x0, y1 - y0};
+	}
+
+	// Smallest rectangle containing both
+	Rect unite(const Rect& o) const {
+		if (empty()) return o;
+		if (o.empty()) return *this;
+		int x0 = std::min(x, o.x);
+		int y0 = std::min(y, o.y);
+		int x1 = std::max(right(), o.right());
+		int y1 = std::max(bottom(), o.bottom());
+		return Rect{x0, y0, x1 - x0, y1 - y0};
+	}
+
+	// Smallest rectangle covering this one at 1/divisor of the resolution,
+	// for non-negative coordinates
+	Rect scaledDown(int divisor) const {
+		int x0 = x / divisor;
+		int y0 = y / divisor;
+		return Rect{x0, y0, (right() + divisor - 1) / divisor - x0, (bottom() + divisor - 1) / divisor - y0};
+	}
+
+	// The rectangle a scaledDown() one stands for at full resolution
+	Rect scaledUp(int divisor) const {
+		return Rect{x * divisor, y * divisor, width * divisor, height * divisor};
+	}
+
+	bool contains(const Rect& o) const {
+		return o.x >= x && o.y >= y && o.right() <= right() && o.bottom() <= bottom();
+	}
+
+	bool operator==(const Rect& o) const = default;
+};
+
+// A loose set of rectangles, used to accumulate damage between captures.
+//
+// Rectangles that overlap or nearly touch are merged as they are added, as
+// long as their bounding box doesn't cover much more than the two did. Once
+// there are more than MAX_RECTS rectangles left, everything collapses into a
+// single bounding box, since past that point issuing one big capture is
+// cheaper than many small ones.
+class DirtyRegion {
+public:
+	static constexpr std::size_t MAX_RECTS = 32;
+
+	void add(Rect r) {
+		if (r.empty()) {
+			return;
+		}
+
+		// keep merging until r no longer absorbs anything
+		bool merged = true;
+		while (merged) {
+			merged = false;
+			for (std::size_t i = 0; i < list.size(); i++) {
+				Rect u = r.unite(list[i]);
+				if (u.area() <= (r.area() + list[i].area()) * 5 / 4 + SLACK) {
+					r = u;
+					list[i] = list.back();
+					list.pop_back();
+					merged = true;
+					break;
+				}
+			}
+		}
+
+		list.push_back(r);
+
+		if (list.size() > MAX_RECTS) {
+			Rect b = bounds();
+			list.clear();
+			list.push_back(b);
+		}
+	}
+
+	void add(const DirtyRegion& other) {
+		for (const Rect& r : other.list) {
+			add(r);
+		}
+	}
+
+	// Drops everything outside of `clip`
+	void clip(const Rect& clip) {
+		std::size_t n = 0;
+		for (const Rect& r : list) {
+			Rect c = r.intersect(clip);
+			if (!c.empty()) {
+				list[n++] = c;
+			}
+		}
+		list.resize(n);
+	}
+
+	// Removes `hole`, splitting rectangles that only partially overlap it
+	// into the strips left around it
+	void subtract(const Rect& hole) {
+		std::vector<Rect> out;
+		for (const Rect& r : list) {
+			Rect c = r.intersect(hole);
+			if (c.empty()) {
+				out.push_back(r);
+				continue;
+			}
+
+			if (c.y > r.y) {
+				out.push_back(Rect{r.x, r.y, r.width, c.y - r.y});
+			}
+			if (c.bottom() < r.bottom()) {
+				out.push_back(Rect{r.x, c.bottom(), r.width, r.bottom() - c.bottom()});
+			}
+			if (c.x > r.x) {
+				out.push_back(Rect{r.x, c.y, c.x - r.x, c.height});
+			}
+			if (c.right() < r.right()) {
+				out.push_back(Rect{c.right(), c.y, r.right() - c.right(), c.height});
+			}
+		}
+		list = std::move(out);
+	}
+
+	Rect bounds() const {
+		Rect b{};
+		for (const Rect& r : list) {
+			b = b.unite(r);
+		}
+		return b;
+	}
+
+	// Sum of the areas, overlaps counted twice
+	std::int64_t area() const {
+		std::int64_t a = 0;
+		for (const Rect& r : list) {
+			a += r.area();
+		}
+		return a;
+	}
+
+	bool empty() const {
+		return list.empty();
+	}
+
+	void clear() {
+		list.clear();
+	}
+
+	const std::vector<Rect>& rects() const {
+		return list;
+	}
+
+private:
+	// lets thin neighbouring strips (e.g. lines of text) merge
+	static constexpr std::int64_t SLACK = 64 * 64;
+
+	std::vector<Rect> list;
+};
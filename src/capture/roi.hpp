@@ -0,0 +1,70 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <glm/glm.hpp>
+
+#include "../nav.hpp"
+#include "region.hpp"
+
+// How many frames ahead the capture region anticipates camera movement. The
+// capture thread lags the camera by at least a frame or two, so the margin
+// has to cover where the view will be once the pixels arrive.
+const float ROI_LOOKAHEAD_FRAMES = 3.0f;
+// Extra border on every side, so rounding and small drags never expose
+// stale pixels at the window edge.
+const int ROI_MIN_MARGIN = 32;
+// Half the side of the square around the pointer that live capture keeps at
+// the full rate, in window pixels
+const float ROI_CURSOR_RADIUS = 128.0f;
+
+// Returns the part of the screenshot that `camera` shows in a window of
+// `windowSize`, in screenshot pixels, clipped to the screenshot. The rectangle
+// is widened in the direction the camera is moving and, when zooming out, to
+// the size the view will have `lookahead` seconds from now.
+Rect viewportRect(const Camera& camera,
+	const glm::vec2& windowSize,
+	const glm::vec2& screenSize,
+	float lookahead) {
+	float scale = camera.scale;
+	if (camera.deltaScale < 0.0f) {
+		scale = std::max(scale + camera.deltaScale * lookahead, 0.0001f);
+	}
+
+	glm::vec2 center = screenSize * 0.5f + camera.position;
+	glm::vec2 half = windowSize / (2.0f * scale);
+	glm::vec2 travel = camera.velocity * lookahead;
+
+	float x0 = center.x - half.x - std::max(-travel.x, 0.0f) - ROI_MIN_MARGIN;
+	float x1 = center.x + half.x + std::max(travel.x, 0.0f) + ROI_MIN_MARGIN;
+	float y0 = center.y - half.y - std::max(-travel.y, 0.0f) - ROI_MIN_MARGIN;
+	float y1 = center.y + half.y + std::max(travel.y, 0.0f) + ROI_MIN_MARGIN;
+
+	Rect r{
+		(int)std::floor(x0),
+		(int)std::floor(y0),
+		(int)std::ceil(x1 - std::floor(x0)),
+		(int)std::ceil(y1 - std::floor(y0))
+	};
+
+	return r.intersect(Rect{0, 0, (int)screenSize.x, (int)screenSize.y});
+}
+
+// Returns the part of the screenshot around what the pointer at `mouse` (in
+// window coordinates) points at, clipped to the screenshot
+Rect cursorRect(const Camera& camera,
+	const glm::vec2& windowSize,
+	const glm::vec2& screenSize,
+	const glm::vec2& mouse) {
+	glm::vec2 center = screenSize * 0.5f + camera.position + (mouse - windowSize * 0.5f) / camera.scale;
+	float half = ROI_CURSOR_RADIUS / camera.scale;
+
+	Rect r{
+		(int)std::floor(center.x - half),
+		(int)std::floor(center.y - half),
+		(int)std::ceil(2.0f * half),
+		(int)std::ceil(2.0f * half)
+	};
+
+	return r.intersect(Rect{0, 0, (int)screenSize.x, (int)screenSize.y});
+}
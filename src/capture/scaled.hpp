@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstdio>
+#include <vector>
+
+#include <X11/Xlib.h>
+#include <X11/extensions/Xrender.h>
+
+#include "region.hpp"
+#include "shm.hpp"
+#include "source.hpp"
+
+// Captures an area of a drawable at 1/divisor of its resolution, the server
+// doing the downscaling.
+//
+// The drawable is composited through an XRender transform into a pixmap of
+// the reduced size, which is then read over MIT-SHM like any other, so the
+// bytes transferred shrink with the square of the divisor. Everything is in
+// coordinates of the drawable divided by the divisor, see Rect::scaledDown.
+struct ScaledCapture {
+	Display* display;
+	int divisor;
+	// the drawable, transformed
+	Picture source;
+	Pixmap pixmap;
+	Picture target;
+	// area of the drawable captured, and the same area downscaled
+	Rect area;
+	Rect scaled;
+	ShmCapture cap;
+	bool scratchFailed;
+};
+
+// Returns false if the server can't do it, e.g. without XRender
+bool initScaledCapture(ScaledCapture& sc, Display* display, Drawable drawable, Visual* visual, int depth,
+	const Rect& area, int divisor)
+{
+	sc = ScaledCapture{};
+
+	int eventBase, errorBase;
+	if (!XRenderQueryExtension(display, &eventBase, &errorBase)) {
+		fprintf(stderr, "[WARN] XRender is not available, captures won't be downscaled\n");
+		return false;
+	}
+
+	XRenderPictFormat* format = XRenderFindVisualFormat(display, visual);
+	if (!format) {
+		return false;
+	}
+
+	sc.display = display;
+	sc.divisor = divisor;
+	sc.area = area;
+	sc.scaled = area.scaledDown(divisor);
+
+	XRenderPictureAttributes pa{};
+	pa.subwindow_mode = IncludeInferiors;
+	sc.source = XRenderCreatePicture(display, drawable, format, CPSubwindowMode, &pa);
+
+	// maps every target pixel to `divisor` source pixels in each direction
+	XTransform transform = {{
+		{XDoubleToFixed(divisor), XDoubleToFixed(0), XDoubleToFixed(0)},
+		{XDoubleToFixed(0), XDoubleToFixed(divisor), XDoubleToFixed(0)},
+		{XDoubleToFixed(0), XDoubleToFixed(0), XDoubleToFixed(1)}
+	}};
+	XRenderSetPictureTransform(display, sc.source, &transform);
+	// averages what it skips on pixman versions that can
+	XRenderSetPictureFilter(display, sc.source, FilterGood, nullptr, 0);
+
+	sc.pixmap = XCreatePixmap(display, DefaultRootWindow(display), sc.scaled.width, sc.scaled.height, depth);
+	sc.target = XRenderCreatePicture(display, sc.pixmap, format, 0, nullptr);
+
+	if (!initShmCapture(sc.cap, display, sc.pixmap, visual, depth, Rect{0, 0, sc.scaled.width, sc.scaled.height})) {
+		XRenderFreePicture(display, sc.target);
+		XFreePixmap(display, sc.pixmap);
+		XRenderFreePicture(display, sc.source);
+		sc.display = nullptr;
+		return false;
+	}
+	return true;
+}
+
+void destroyScaledCapture(ScaledCapture& sc) {
+	if (!sc.display) {
+		return;
+	}
+
+	destroyShmCapture(sc.cap);
+	XRenderFreePicture(sc.display, sc.target);
+	XFreePixmap(sc.display, sc.pixmap);
+	XRenderFreePicture(sc.display, sc.source);
+	sc.display = nullptr;
+}
+
+// Downscales the parts of `rects` (in drawable coordinates) inside the area
+// and captures them into sc.cap
+bool captureScaled(ScaledCapture& sc, const std::vector<Rect>& rects) {
+	std::vector<Rect> local;
+	for (const Rect& r : rects) {
+		Rect s = r.intersect(sc.area).scaledDown(sc.divisor).intersect(sc.scaled);
+		if (s.empty()) {
+			continue;
+		}
+
+		XRenderComposite(sc.display, PictOpSrc, sc.source, None, sc.target,
+			s.x, s.y, 0, 0,
+			s.x - sc.scaled.x, s.y - sc.scaled.y, s.width, s.height);
+		local.push_back(Rect{s.x - sc.scaled.x, s.y - sc.scaled.y, s.width, s.height});
+	}
+
+	if (local.size() == 1 && local[0].width == sc.scaled.width && local[0].height == sc.scaled.height) {
+		return capture(sc.cap);
+	}
+
+	if (!sc.cap.scratch && !sc.scratchFailed) {
+		sc.scratchFailed = !attachShmScratch(sc.cap, (std::size_t)sc.cap.image->bytes_per_line * sc.cap.height / 2);
+	}
+#ifdef CAPTURE_SHM_FD
+	return captureRects(sc.cap, local);
+#else
+	bool ok = true;
+	for (const Rect& r : local) {
+		ok = captureRect(sc.cap, r) && ok;
+	}
+	return ok;
+#endif
+}
+
+ImageView scaledImage(const ScaledCapture& sc) {
+	return ImageView{
+		(const std::uint8_t*)sc.cap.image->data,
+		sc.cap.width,
+		sc.cap.height,
+		sc.cap.image->bytes_per_line,
+		sc.cap.format
+	};
+}
@@ -0,0 +1,414 @@
+#pragma once
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#include <vector>
+
+#include "region.hpp"
+#include "shm_segment.hpp"
+#include "source.hpp"
+
+struct ShmCapture {
+	Display* display;
+	// what is captured from, normally the root window
+	Drawable drawable;
+	Visual* visual;
+	int depth;
+	XImage* image;
+	PixelFormat format;
+	std::shared_ptr<ShmSegment> segment;
+	// origin of the captured area in `drawable`
+	int x;
+	int y;
+	int width;
+	int height;
+	std::uint8_t* pixels;
+
+	// Optional second segment that partial captures land in before being
+	// copied into `image`. See attachShmScratch.
+	std::shared_ptr<ShmSegment> scratch;
+};
+
+// Prepares capturing `area` of `drawable`, whose pixels are laid out as
+// `visual` at `depth`, over an existing connection. Returns false if MIT-SHM
+// can't be used with this server.
+bool initShmCapture(ShmCapture& cap, Display* display, Drawable drawable, Visual* visual, int depth, const Rect& area)
+{
+    cap = ShmCapture{};
+
+    cap.display = display;
+
+    if (!XShmQueryExtension(cap.display)) {
+    	fprintf(stderr, "[WARN] MIT-SHM is not available\n");
+    	return false;
+    }
+
+    cap.drawable = drawable;
+    cap.visual   = visual;
+    cap.depth    = depth;
+
+    cap.x      = area.x;
+    cap.y      = area.y;
+    cap.width  = area.width;
+    cap.height = area.height;
+
+    // The image only learns its row layout here, the segment is picked
+    // once that is known
+    XShmSegmentInfo layout{};
+    cap.image = XShmCreateImage(
+        cap.display,
+        cap.visual,
+        cap.depth,
+        ZPixmap,
+        nullptr,
+        &layout,
+        cap.width,
+        cap.height
+    );
+
+    if (!cap.image) {
+    	fprintf(stderr, "[ERROR] Failed to create image!\n");
+    	return false;
+    }
+
+    cap.format = pixelFormatOf(cap.image);
+    if (cap.format == PixelFormat::Unknown) {
+    	fprintf(stderr, "[WARN] MIT-SHM: unsupported %d bpp visual\n", cap.image->bits_per_pixel);
+    	XDestroyImage(cap.image);
+    	return false;
+    }
+
+    cap.segment = acquireShmSegment(cap.display, (std::size_t)cap.image->bytes_per_line * cap.image->height);
+
+    if (!cap.segment) {
+    	fprintf(stderr, "[WARN] Failed to attach shared memory to X server!\n");
+    	XDestroyImage(cap.image);
+    	return false;
+    }
+
+    cap.image->obdata = (char*)&cap.segment->info;
+    cap.image->data = cap.segment->info.shmaddr;
+
+    return true;
+}
+
+// Prepares capturing `area` (in root coordinates) of the root window
+bool initShmCapture(ShmCapture& cap, Display* display, const Rect& area) {
+	int screen = DefaultScreen(display);
+	return initShmCapture(cap, display,
+		RootWindow(display, screen),
+		DefaultVisual(display, screen),
+		DefaultDepth(display, screen),
+		area
+	);
+}
+
+// Segments go back to the pool, see trimShmSegments
+void destroyShmCapture(ShmCapture& cap) {
+	XDestroyImage(cap.image);
+	cap.image = nullptr;
+	cap.segment.reset();
+	cap.scratch.reset();
+}
+
+bool capture(ShmCapture& cap) {
+	return XShmGetImage(cap.display,
+		cap.drawable,
+		cap.image,
+		cap.x, cap.y,
+		AllPlanes
+	);
+}
+
+// Allocates the scratch segment used by captureRect. Rectangles whose pixels
+// don't fit in `bytes` are captured as full-width bands instead, so this is
+// optional.
+bool attachShmScratch(ShmCapture& cap, std::size_t bytes) {
+	cap.scratch = acquireShmSegment(cap.display, bytes);
+	if (!cap.scratch) {
+		fprintf(stderr, "[ERROR] Failed to attach scratch segment to X server!\n");
+		return false;
+	}
+	return true;
+}
+
+// Captures only the part of `rect` (in the coordinates of cap.drawable) that
+// lies inside the captured area into the matching area of cap.image, leaving
+// the rest of the image untouched.
+bool captureRect(ShmCapture& cap, const Rect& rect) {
+	Rect r = rect.intersect(Rect{cap.x, cap.y, cap.width, cap.height});
+	if (r.empty()) {
+		return true;
+	}
+
+	// position inside cap.image
+	int lx = r.x - cap.x;
+	int ly = r.y - cap.y;
+
+	int bpp = cap.image->bits_per_pixel / 8;
+	// rows are padded to 32 bits, which 24 bpp rows need room for
+	std::size_t rowBytes = ((std::size_t)r.width * cap.image->bits_per_pixel + 31) / 32 * 4;
+
+	if (cap.scratch && rowBytes * r.height <= cap.scratch->size) {
+		// The server always writes tightly packed rows, so the rectangle has
+		// to go through the scratch segment and get copied into place.
+		XImage* sub = XShmCreateImage(cap.display, cap.visual, cap.depth, ZPixmap,
+			cap.scratch->info.shmaddr, &cap.scratch->info, r.width, r.height);
+		if (!sub) {
+			return false;
+		}
+
+		if (!XShmGetImage(cap.display, cap.drawable, sub, r.x, r.y, AllPlanes)) {
+			XDestroyImage(sub);
+			return false;
+		}
+
+		for (int row = 0; row < r.height; row++) {
+			std::memcpy(
+				cap.image->data + (std::size_t)(ly + row) * cap.image->bytes_per_line + (std::size_t)lx * bpp,
+				sub->data + (std::size_t)row * sub->bytes_per_line,
+				(std::size_t)r.width * bpp
+			);
+		}
+
+		XDestroyImage(sub);
+		return true;
+	}
+	else {
+		// A full-width band shares the row layout of cap.image, so the server
+		// can write it in place.
+		XImage* band = XShmCreateImage(cap.display, cap.visual, cap.depth, ZPixmap,
+			cap.image->data + (std::size_t)ly * cap.image->bytes_per_line,
+			&cap.segment->info, cap.width, r.height);
+		if (!band) {
+			return false;
+		}
+
+		Status ok = XShmGetImage(cap.display, cap.drawable, band, cap.x, r.y, AllPlanes);
+		XDestroyImage(band);
+		return ok;
+	}
+}
+
+#ifdef CAPTURE_SHM_FD
+// Same as calling captureRect on every rectangle of `rects`, but costs about
+// one round-trip instead of one per rectangle. Xlib waits for the reply of
+// every XShmGetImage, so the requests go through xcb instead: they are all
+// sent at once, each into its own slice of the scratch segment, and the
+// replies collected afterwards. When the scratch segment fills up, what was
+// sent so far is collected and it starts over.
+bool captureRects(ShmCapture& cap, const std::vector<Rect>& rects) {
+	struct Request {
+		xcb_shm_get_image_cookie_t cookie;
+		Rect rect;
+		// where the pixels land in the scratch segment, if they do
+		std::size_t offset;
+		bool scratch;
+	};
+
+	xcb_connection_t* conn = XGetXCBConnection(cap.display);
+	// whatever Xlib buffered has to go first
+	XFlush(cap.display);
+
+	const Rect area{cap.x, cap.y, cap.width, cap.height};
+	int bitsPerPixel = cap.image->bits_per_pixel;
+	int bpp = bitsPerPixel / 8;
+	std::size_t scratchSize = cap.scratch ? cap.scratch->size : 0;
+
+	std::vector<Request> requests;
+	std::size_t used = 0;
+	bool ok = true;
+
+	auto collect = [&]() {
+		for (const Request& req : requests) {
+			xcb_generic_error_t* err = nullptr;
+			xcb_shm_get_image_reply_t* reply = xcb_shm_get_image_reply(conn, req.cookie, &err);
+			if (!reply) {
+				free(err);
+				ok = false;
+				continue;
+			}
+			free(reply);
+
+			if (!req.scratch) {
+				continue;
+			}
+
+			// rows are padded to 32 bits, like in any ZPixmap
+			std::size_t rowBytes = ((std::size_t)req.rect.width * bitsPerPixel + 31) / 32 * 4;
+			for (int row = 0; row < req.rect.height; row++) {
+				std::memcpy(
+					cap.image->data
+						+ (std::size_t)(req.rect.y - cap.y + row) * cap.image->bytes_per_line
+						+ (std::size_t)(req.rect.x - cap.x) * bpp,
+					cap.scratch->info.shmaddr + req.offset + (std::size_t)row * rowBytes,
+					(std::size_t)req.rect.width * bpp
+				);
+			}
+		}
+		requests.clear();
+		used = 0;
+	};
+
+	for (const Rect& rect : rects) {
+		Rect r = rect.intersect(area);
+		if (r.empty()) {
+			continue;
+		}
+
+		std::size_t size = ((std::size_t)r.width * bitsPerPixel + 31) / 32 * 4 * r.height;
+		bool scratch = r.width != cap.width && size <= scratchSize;
+
+		if (scratch && used + size > scratchSize) {
+			collect();
+		}
+
+		Request req{};
+		req.scratch = scratch;
+		if (scratch) {
+			req.rect = r;
+			req.offset = used;
+			used += size;
+			req.cookie = xcb_shm_get_image(conn, (xcb_drawable_t)cap.drawable,
+				(std::int16_t)r.x, (std::int16_t)r.y, (std::uint16_t)r.width, (std::uint16_t)r.height,
+				~0u, XCB_IMAGE_FORMAT_Z_PIXMAP,
+				(xcb_shm_seg_t)cap.scratch->info.shmseg, (std::uint32_t)req.offset);
+		}
+		else {
+			// a full-width band shares the row layout of cap.image, so the
+			// server can write it in place
+			req.rect = Rect{cap.x, r.y, cap.width, r.height};
+			req.cookie = xcb_shm_get_image(conn, (xcb_drawable_t)cap.drawable,
+				(std::int16_t)cap.x, (std::int16_t)r.y, (std::uint16_t)cap.width, (std::uint16_t)r.height,
+				~0u, XCB_IMAGE_FORMAT_Z_PIXMAP,
+				(xcb_shm_seg_t)cap.segment->info.shmseg,
+				(std::uint32_t)((std::size_t)(r.y - cap.y) * cap.image->bytes_per_line));
+		}
+		requests.push_back(req);
+	}
+
+	collect();
+	return ok;
+}
+#endif
+
+#ifdef CAPTURE_XRENDER
+// builds on ShmCapture, and ShmSource builds on it
+#include "scaled.hpp"
+#endif
+
+// MIT-SHM backend: the server writes straight into a shared segment, so a
+// capture costs no socket traffic.
+class ShmSource : public CaptureSource {
+public:
+	~ShmSource() override {
+#ifdef CAPTURE_XRENDER
+		destroyScaledCapture(scaled);
+#endif
+		if (opened) {
+			destroyShmCapture(cap);
+		}
+	}
+
+	const char* name() const override {
+		return "x11-shm";
+	}
+
+	bool open(Display* display, const Rect& area) override {
+		if (!initShmCapture(cap, display, area)) {
+			return false;
+		}
+		bounds = area;
+		opened = true;
+		return true;
+	}
+
+	ImageView image() const override {
+#ifdef CAPTURE_XRENDER
+		if (scaleDivisor > 1) {
+			return scaledImage(scaled);
+		}
+#endif
+		return ImageView{
+			(const std::uint8_t*)cap.image->data,
+			cap.width,
+			cap.height,
+			cap.image->bytes_per_line,
+			cap.format
+		};
+	}
+
+#ifdef CAPTURE_XRENDER
+	bool setDivisor(int divisor) override {
+		if (divisor == scaleDivisor) {
+			return true;
+		}
+
+		destroyScaledCapture(scaled);
+		scaleDivisor = 1;
+		if (divisor > 1 && !initScaledCapture(scaled, cap.display, cap.drawable, cap.visual, cap.depth, bounds, divisor)) {
+			return false;
+		}
+		scaleDivisor = divisor;
+		return true;
+	}
+#endif
+
+protected:
+	bool doGrab() override {
+#ifdef CAPTURE_XRENDER
+		if (scaleDivisor > 1) {
+			return captureScaled(scaled, {bounds});
+		}
+#endif
+		return capture(cap);
+	}
+
+	bool doGrabRect(const Rect& r) override {
+#ifdef CAPTURE_XRENDER
+		if (scaleDivisor > 1) {
+			return captureScaled(scaled, {r});
+		}
+#endif
+		// partial captures only happen in live mode, no need to pay for
+		// the scratch segment before
+		if (!cap.scratch && !scratchFailed) {
+			scratchFailed = !attachShmScratch(cap, (std::size_t)cap.image->bytes_per_line * cap.height / 2);
+		}
+		return captureRect(cap, r);
+	}
+
+#if defined(CAPTURE_SHM_FD) || defined(CAPTURE_XRENDER)
+	bool doGrabRects(const std::vector<Rect>& rects) override {
+#ifdef CAPTURE_XRENDER
+		if (scaleDivisor > 1) {
+			return captureScaled(scaled, rects);
+		}
+#endif
+#ifdef CAPTURE_SHM_FD
+		if (!cap.scratch && !scratchFailed) {
+			scratchFailed = !attachShmScratch(cap, (std::size_t)cap.image->bytes_per_line * cap.height / 2);
+		}
+		return captureRects(cap, rects);
+#else
+		return CaptureSource::doGrabRects(rects);
+#endif
+	}
+#endif
+
+private:
+	ShmCapture cap{};
+	bool opened = false;
+	bool scratchFailed = false;
+#ifdef CAPTURE_XRENDER
+	ScaledCapture scaled{};
+#endif
+};
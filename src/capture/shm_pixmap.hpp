@@ -0,0 +1,223 @@
+#pragma once
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+
+#include <cstdio>
+#include <cstdint>
+#include <memory>
+
+#include "pixel_format.hpp"
+#include "region.hpp"
+#include "shm_segment.hpp"
+#include "source.hpp"
+
+// One pixmap living in a shared segment, so what the server draws into it
+// can be read straight from memory
+struct ShmPixmap {
+	std::shared_ptr<ShmSegment> segment;
+	Pixmap pixmap;
+};
+
+// MIT-SHM pixmap backend: the root window is copied into a pixmap whose
+// pixels live in shared memory with a plain XCopyArea.
+//
+// Unlike XShmGetImage, nothing waits for the copy unless asked to. The
+// copy is followed by a 1x1 XShmPutImage with send_event set, whose
+// XShmCompletionEvent arrives once everything before it, the copy
+// included, has been carried out. beginGrab/finishGrab use that to let
+// the caller do something useful (e.g. render the previous frame) while
+// the server copies. Full captures go into a second pixmap and are swapped
+// in once complete, so image() stays readable in the meantime.
+class ShmPixmapSource : public CaptureSource {
+public:
+	~ShmPixmapSource() override {
+		close();
+	}
+
+	const char* name() const override {
+		return "x11-shm-pixmap";
+	}
+
+	bool open(Display* display, const Rect& area) override {
+		int major, minor;
+		Bool pixmaps;
+		if (!XShmQueryVersion(display, &major, &minor, &pixmaps) || !pixmaps || XShmPixmapFormat(display) != ZPixmap) {
+			fprintf(stderr, "[WARN] MIT-SHM pixmaps are not available\n");
+			return false;
+		}
+
+		this->display = display;
+		int screen = DefaultScreen(display);
+		root = RootWindow(display, screen);
+		Visual* visual = DefaultVisual(display, screen);
+		int depth = DefaultDepth(display, screen);
+
+		// an image of the same size has the same row layout as the pixmaps
+		XShmSegmentInfo layout{};
+		XImage* probe = XShmCreateImage(display, visual, depth, ZPixmap, nullptr, &layout, area.width, area.height);
+		if (!probe) {
+			return false;
+		}
+		format = pixelFormatOf(probe);
+		stride = probe->bytes_per_line;
+		XDestroyImage(probe);
+
+		if (format == PixelFormat::Unknown) {
+			fprintf(stderr, "[WARN] MIT-SHM pixmaps: unsupported visual\n");
+			return false;
+		}
+
+		bounds = area;
+		for (ShmPixmap& buf : buffers) {
+			buf.segment = acquireShmSegment(display, (std::size_t)stride * area.height);
+			if (!buf.segment) {
+				close();
+				return false;
+			}
+			buf.pixmap = XShmCreatePixmap(display, root, buf.segment->info.shmaddr, &buf.segment->info,
+				area.width, area.height, depth);
+		}
+
+		XGCValues values{};
+		values.subwindow_mode = IncludeInferiors;
+		gc = XCreateGC(display, root, GCSubwindowMode, &values);
+
+		marker.segment = acquireShmSegment(display, 4);
+		if (!marker.segment) {
+			close();
+			return false;
+		}
+		marker.pixmap = XCreatePixmap(display, root, 1, 1, depth);
+		markerImage = XShmCreateImage(display, visual, depth, ZPixmap,
+			marker.segment->info.shmaddr, &marker.segment->info, 1, 1);
+		completionType = XShmGetEventBase(display) + ShmCompletion;
+
+		XSync(display, False);
+		return true;
+	}
+
+	ImageView image() const override {
+		return ImageView{
+			(const std::uint8_t*)buffers[front].segment->info.shmaddr,
+			bounds.width,
+			bounds.height,
+			stride,
+			format
+		};
+	}
+
+	void handleEvent(const XEvent& ev) override {
+		if (isCompletion(ev)) {
+			completed = true;
+		}
+	}
+
+	// Starts copying the whole area into the back pixmap and returns right
+	// away
+	bool beginGrab() override {
+		if (pending) {
+			return true;
+		}
+
+		const ShmPixmap& back = buffers[1 - front];
+		XCopyArea(display, root, back.pixmap, gc, bounds.x, bounds.y, bounds.width, bounds.height, 0, 0);
+		XShmPutImage(display, marker.pixmap, gc, markerImage, 0, 0, 0, 0, 1, 1, True);
+		XFlush(display);
+
+		pending = true;
+		completed = false;
+		return true;
+	}
+
+	// Waits for the copy started by beginGrab and makes it image()
+	bool finishGrab() override {
+		if (!pending) {
+			return true;
+		}
+
+		if (!completed) {
+			XEvent ev;
+			XIfEvent(display, &ev, [](Display*, XEvent* e, XPointer self) -> Bool {
+				return ((ShmPixmapSource*)self)->isCompletion(*e);
+			}, (XPointer)this);
+		}
+
+		pending = false;
+		front = 1 - front;
+		return true;
+	}
+
+protected:
+	bool doGrab() override {
+		beginGrab();
+		return finishGrab();
+	}
+
+	bool doGrabRect(const Rect& r) override {
+		// straight into the front pixmap, the back one may be a frame behind
+		finishGrab();
+		XCopyArea(display, root, buffers[front].pixmap, gc,
+			r.x, r.y, r.width, r.height,
+			r.x - bounds.x, r.y - bounds.y);
+		XSync(display, False);
+		return true;
+	}
+
+private:
+	bool isCompletion(const XEvent& ev) const {
+		return ev.type == completionType
+			&& ((const XShmCompletionEvent&)ev).drawable == marker.pixmap;
+	}
+
+	void close() {
+		if (!display) {
+			return;
+		}
+
+		// the server may still be writing into the segments
+		XSync(display, False);
+
+		for (ShmPixmap* buf : {&buffers[0], &buffers[1], &marker}) {
+			if (buf->pixmap) {
+				XFreePixmap(display, buf->pixmap);
+				buf->pixmap = 0;
+			}
+		}
+		if (markerImage) {
+			XDestroyImage(markerImage);
+			markerImage = nullptr;
+		}
+		if (gc) {
+			XFreeGC(display, gc);
+			gc = nullptr;
+		}
+		XSync(display, False);
+
+		for (ShmPixmap* buf : {&buffers[0], &buffers[1], &marker}) {
+			buf->segment.reset();
+		}
+		display = nullptr;
+	}
+
+	Display* display = nullptr;
+	Window root = 0;
+	PixelFormat format = PixelFormat::Unknown;
+	int stride = 0;
+
+	ShmPixmap buffers[2]{};
+	// index of the buffer image() shows
+	int front = 0;
+	GC gc = nullptr;
+
+	// target of the 1x1 put whose completion marks the end of a copy
+	ShmPixmap marker{};
+	XImage* markerImage = nullptr;
+	int completionType = 0;
+
+	// a copy was started by beginGrab and not finished yet
+	bool pending = false;
+	// its completion event was already read by someone else
+	bool completed = false;
+};
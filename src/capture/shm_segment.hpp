@@ -0,0 +1,303 @@
+#pragma once
+
+#include <X11/Xlib.h>
+#include <X11/extensions/XShm.h>
+
+#include <fcntl.h>
+#include <sys/ipc.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#ifdef CAPTURE_SHM_FD
+#include <X11/Xlib-xcb.h>
+#include <xcb/shm.h>
+#endif
+
+#include "xlib.hpp"
+
+// Size of the huge pages asked for with useShmHugePages
+const std::size_t SHM_HUGE_PAGE = 2 * 1024 * 1024;
+
+// A block of memory shared with the X server, detached and unmapped when
+// the last reference to it goes away.
+//
+// Segments are memfds handed to the server with ShmAttachFd whenever the
+// server and libxcb support it (MIT-SHM 1.2). Unlike SysV segments they
+// are gone as soon as both sides let go, even if clearview crashes, and
+// don't count against kernel.shmmni. Otherwise a SysV segment is used,
+// readable by us only and marked for removal right after the server
+// attached it, which frees it just the same.
+struct ShmSegment {
+	Display* display = nullptr;
+	XShmSegmentInfo info{};
+	// usable bytes at info.shmaddr
+	std::size_t size = 0;
+	bool memfd = false;
+	// kept for memfd segments so other connections can attach them too
+	int fd = -1;
+	// set on segments attached to another connection by shareShmSegment,
+	// the memory is then `owner`'s
+	std::shared_ptr<ShmSegment> owner;
+
+	ShmSegment() = default;
+	ShmSegment(const ShmSegment&) = delete;
+	ShmSegment& operator=(const ShmSegment&) = delete;
+
+	~ShmSegment() {
+		if (!info.shmaddr) {
+			return;
+		}
+		if (info.shmseg) {
+			XShmDetach(display, &info);
+		}
+		if (owner) {
+			return;
+		}
+		if (memfd) {
+			munmap(info.shmaddr, size);
+			if (fd >= 0) {
+				close(fd);
+			}
+		}
+		else {
+			shmdt(info.shmaddr);
+		}
+	}
+};
+
+// Segments handed out by acquireShmSegment. Those nobody else holds are
+// free, and handed out again when something of the same size or smaller
+// is asked for on the same connection, e.g. after a resolution change.
+//
+// The pool is never destroyed: detaching from a static destructor could
+// touch a closed connection, and at exit the server drops the segments
+// along with the connection anyway.
+static std::mutex shmPoolMutex;
+static std::vector<std::shared_ptr<ShmSegment>>& shmPool = *new std::vector<std::shared_ptr<ShmSegment>>();
+static bool shmHugePages = false;
+
+// Backs the segments allocated from now on with huge pages when the kernel
+// has some to spare, which saves TLB misses when copying whole screens
+void useShmHugePages(bool enable) {
+	shmHugePages = enable;
+}
+
+#ifdef CAPTURE_SHM_FD
+// Hands `fd` to the server behind `display`, which takes it over. Returns
+// the new segment's id, or 0 if the server refused it.
+static xcb_shm_seg_t sendShmFd(Display* display, int fd) {
+	// libxcb closes the descriptor once it is sent; Xlib has to hand over
+	// what it buffered first so the requests stay in order
+	xcb_connection_t* conn = XGetXCBConnection(display);
+	XFlush(display);
+
+	xcb_shm_seg_t id = xcb_generate_id(conn);
+	xcb_generic_error_t* err = xcb_request_check(conn, xcb_shm_attach_fd_checked(conn, id, fd, 0));
+	if (err) {
+		free(err);
+		return 0;
+	}
+	return id;
+}
+
+// Maps a memfd of at least `bytes` and hands it to the server. Returns
+// false if the server can't take file descriptors.
+static bool attachShmFd(ShmSegment& seg, std::size_t bytes) {
+	int major, minor;
+	Bool pixmaps;
+	if (!XShmQueryVersion(seg.display, &major, &minor, &pixmaps) || (major == 1 && minor < 2)) {
+		return false;
+	}
+
+	int fd = -1;
+	std::size_t size = 0;
+	void* addr = MAP_FAILED;
+
+	if (shmHugePages) {
+		size = (bytes + SHM_HUGE_PAGE - 1) / SHM_HUGE_PAGE * SHM_HUGE_PAGE;
+		fd = memfd_create("clearview-shm", MFD_CLOEXEC | MFD_HUGETLB);
+		if (fd >= 0 && ftruncate(fd, (off_t)size) == 0) {
+			// without MAP_POPULATE a shortage of huge pages only shows up
+			// as a SIGBUS on first touch
+			addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+		}
+		if (addr == MAP_FAILED) {
+			fprintf(stderr, "[WARN] No huge pages available for capture segments (see vm.nr_hugepages)\n");
+			if (fd >= 0) {
+				close(fd);
+			}
+			fd = -1;
+		}
+	}
+
+	if (addr == MAP_FAILED) {
+		size = (bytes + 4095) / 4096 * 4096;
+		fd = memfd_create("clearview-shm", MFD_CLOEXEC);
+		if (fd < 0) {
+			return false;
+		}
+		if (ftruncate(fd, (off_t)size) != 0) {
+			close(fd);
+			return false;
+		}
+		addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (addr == MAP_FAILED) {
+			close(fd);
+			return false;
+		}
+		if (shmHugePages) {
+			// transparent huge pages, if shmem_enabled allows it
+			madvise(addr, size, MADV_HUGEPAGE);
+		}
+	}
+
+	seg.fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	xcb_shm_seg_t id = sendShmFd(seg.display, fd);
+	if (!id) {
+		munmap(addr, size);
+		if (seg.fd >= 0) {
+			close(seg.fd);
+			seg.fd = -1;
+		}
+		return false;
+	}
+
+	seg.info.shmseg = id;
+	seg.info.shmid = -1;
+	seg.info.shmaddr = (char*)addr;
+	seg.info.readOnly = False;
+	seg.size = size;
+	seg.memfd = true;
+	return true;
+}
+#endif
+
+// Allocates a SysV segment of `bytes` and attaches it
+static bool attachShmSysV(ShmSegment& seg, std::size_t bytes) {
+	int shmid = shmget(IPC_PRIVATE, bytes, IPC_CREAT | 0600);
+	if (shmid < 0) {
+		fprintf(stderr, "[ERROR] Invalid shm id\n");
+		return false;
+	}
+
+	char* addr = (char*)shmat(shmid, nullptr, 0);
+	if (addr == (char*)-1) {
+		shmctl(shmid, IPC_RMID, nullptr);
+		return false;
+	}
+
+	seg.info.shmid = shmid;
+	seg.info.shmaddr = addr;
+	seg.info.readOnly = False;
+
+	// XShmAttach fails asynchronously, through an X error, when the server
+	// can't reach our segment (remote displays, separate IPC namespaces)
+	trapXErrors(seg.display);
+	Status ok = XShmAttach(seg.display, &seg.info);
+	bool attachFailed = untrapXErrors(seg.display) > 0;
+
+	// the segment lives on until both sides detach
+	shmctl(shmid, IPC_RMID, nullptr);
+
+	if (!ok || attachFailed) {
+		seg.info.shmseg = 0;
+		shmdt(addr);
+		seg.info.shmaddr = nullptr;
+		return false;
+	}
+
+	seg.size = bytes;
+	return true;
+}
+
+// Returns a segment of at least `bytes` shared with the server behind
+// `display`, reusing a free one when possible, or null if MIT-SHM can't be
+// used with this server.
+std::shared_ptr<ShmSegment> acquireShmSegment(Display* display, std::size_t bytes) {
+	std::lock_guard<std::mutex> lock(shmPoolMutex);
+
+	// the smallest free segment that fits
+	std::shared_ptr<ShmSegment>* best = nullptr;
+	for (auto& seg : shmPool) {
+		if (seg.use_count() == 1 && seg->display == display && seg->size >= bytes
+			&& (!best || seg->size < (*best)->size)) {
+			best = &seg;
+		}
+	}
+	if (best) {
+		return *best;
+	}
+
+	// nothing fits, so the free ones are too small for the new layout
+	shmPool.erase(std::remove_if(shmPool.begin(), shmPool.end(), [&](const std::shared_ptr<ShmSegment>& seg) {
+		return seg.use_count() == 1 && seg->display == display;
+	}), shmPool.end());
+
+	auto seg = std::make_shared<ShmSegment>();
+	seg->display = display;
+
+	bool ok = false;
+#ifdef CAPTURE_SHM_FD
+	ok = attachShmFd(*seg, bytes);
+#endif
+	if (!ok) {
+		ok = attachShmSysV(*seg, bytes);
+	}
+	if (!ok) {
+		return nullptr;
+	}
+
+	shmPool.push_back(seg);
+	return seg;
+}
+
+// Attaches `seg` to another connection to the same server, so that requests
+// sent over `display` can write into it as well. Returns null if that
+// fails. The result isn't pooled, and has to go before `display` is closed.
+std::shared_ptr<ShmSegment> shareShmSegment(const std::shared_ptr<ShmSegment>& seg, Display* display) {
+	auto shared = std::make_shared<ShmSegment>();
+	shared->display = display;
+	shared->info = seg->info;
+	shared->info.shmseg = 0;
+	shared->size = seg->size;
+	shared->memfd = seg->memfd;
+	shared->owner = seg;
+
+	if (seg->memfd) {
+#ifdef CAPTURE_SHM_FD
+		int fd = seg->fd >= 0 ? fcntl(seg->fd, F_DUPFD_CLOEXEC, 0) : -1;
+		shared->info.shmseg = fd >= 0 ? sendShmFd(display, fd) : 0;
+#endif
+		return shared->info.shmseg ? shared : nullptr;
+	}
+
+	// Linux lets a segment marked for removal be attached again as long as
+	// it is still attached somewhere, here by us and by the server
+	trapXErrors(display);
+	Status ok = XShmAttach(display, &shared->info);
+	bool attachFailed = untrapXErrors(display) > 0;
+
+	if (!ok || attachFailed) {
+		shared->info.shmseg = 0;
+		return nullptr;
+	}
+	return shared;
+}
+
+// Frees the segments of `display` nobody holds anymore. Has to be called
+// before the connection is closed.
+void trimShmSegments(Display* display) {
+	std::lock_guard<std::mutex> lock(shmPoolMutex);
+	shmPool.erase(std::remove_if(shmPool.begin(), shmPool.end(), [&](const std::shared_ptr<ShmSegment>& seg) {
+		return seg.use_count() == 1 && seg->display == display;
+	}), shmPool.end());
+}
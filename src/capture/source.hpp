@@ -0,0 +1,199 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#ifdef CAPTURE_X11
+#include <X11/Xlib.h>
+#else
+// only passed along by the sources of other platforms
+typedef struct _XDisplay Display;
+typedef union _XEvent XEvent;
+#endif
+
+#include "pixel_format.hpp"
+#include "region.hpp"
+
+// Largest divisor captures are downscaled by. Past that the capture costs
+// next to nothing anyway.
+const int MAX_CAPTURE_DIVISOR = 16;
+
+// Power of two to downscale captures by when they are shown at `scale`, so
+// that no more pixels are captured than end up on screen
+int captureDivisorFor(float scale) {
+	int divisor = 1;
+	while (divisor < MAX_CAPTURE_DIVISOR && scale * (divisor * 2) <= 1.0f) {
+		divisor *= 2;
+	}
+	return divisor;
+}
+
+// Read-only view of captured pixels: rows of `format`, `stride` bytes apart.
+struct ImageView {
+	const std::uint8_t* data;
+	int width;
+	int height;
+	int stride;
+	PixelFormat format = PixelFormat::BGRA8888;
+};
+
+// When the oldest of some changes on screen was reported
+struct ChangeStamp {
+	// X server time of the report, in milliseconds; 0 if unknown
+	unsigned long serverTime = 0;
+	// when the report reached us; the clock's epoch if unknown
+	std::chrono::steady_clock::time_point seen{};
+};
+
+bool hasChangeStamp(const ChangeStamp& s) {
+	return s.seen != std::chrono::steady_clock::time_point{};
+}
+
+// Makes `into` the older of the two
+void mergeChangeStamp(ChangeStamp& into, const ChangeStamp& s) {
+	if (hasChangeStamp(s) && (!hasChangeStamp(into) || s.seen < into.seen)) {
+		into = s;
+	}
+}
+
+// One way of getting the pixels of an area of the root window into memory.
+//
+// Backends implement open/doGrab/doGrabRect. Callers go through grab(),
+// which also keeps track of how long a full capture takes, so backends can
+// be compared against each other on the running server.
+class CaptureSource {
+public:
+	virtual ~CaptureSource() = default;
+
+	virtual const char* name() const = 0;
+
+	// Prepares capturing `area` (in root coordinates) over `display`.
+	// Returns false, without side effects, if the backend can't work here.
+	virtual bool open(Display* display, const Rect& area) = 0;
+
+	// Pixels as of the last grab. Only valid after a successful open().
+	virtual ImageView image() const = 0;
+
+	// Captures the whole area.
+	bool grab() {
+		auto start = std::chrono::steady_clock::now();
+		bool ok = doGrab();
+		std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+
+		if (ok) {
+			// smooth out the odd slow frame
+			frameCost = frameCost == 0.0 ? ms.count() : frameCost * 0.9 + ms.count() * 0.1;
+		}
+		return ok;
+	}
+
+	// Starts a full capture that finishGrab() completes. Sources that can
+	// capture in the background return right away, and image() keeps the
+	// previous pixels until finishGrab(); the others capture right here.
+	// Not timed like grab().
+	virtual bool beginGrab() {
+		return doGrab();
+	}
+
+	virtual bool finishGrab() {
+		return true;
+	}
+
+	// Captures only the part of `r` (in root coordinates) inside the area,
+	// leaving the rest of image() as it was.
+	bool grab(const Rect& r) {
+		Rect c = r.intersect(bounds);
+		if (c.empty()) {
+			return true;
+		}
+		return doGrabRect(c);
+	}
+
+	// Captures the parts of every rectangle of `region` inside the area.
+	// Sources that can pipeline the requests send them all before waiting
+	// for any, the others grab one rectangle after another.
+	bool grab(const DirtyRegion& region) {
+		std::vector<Rect> rects;
+		for (const Rect& r : region.rects()) {
+			Rect c = r.intersect(bounds);
+			if (!c.empty()) {
+				rects.push_back(c);
+			}
+		}
+		return rects.empty() || doGrabRects(rects);
+	}
+
+	const Rect& area() const {
+		return bounds;
+	}
+
+	// Sources that know by themselves what changed since the last call add it
+	// to `out` and return true. The others return false, and the caller
+	// falls back to XDamage or to full captures.
+	virtual bool pollDamage(DirtyRegion& out) {
+		(void)out;
+		return false;
+	}
+
+	// When the oldest change reported by the last pollDamage() happened, for
+	// sources that can tell
+	virtual ChangeStamp damageStamp() const {
+		return ChangeStamp{};
+	}
+
+	// Sources that listen for events on their connection get every event
+	// read from it.
+	virtual void handleEvent(const XEvent& ev) {
+		(void)ev;
+	}
+
+	// Sources that pick their own size (see openStandaloneCaptures) check
+	// here whether it changed and reallocate if so. Returns true if area()
+	// changed; image() then holds no pixels until the next grab().
+	virtual bool updateArea() {
+		return false;
+	}
+
+	// Sources that can have the server downscale what they capture do so by
+	// `divisor` from the next grab on and return true; image() is then
+	// area().scaledDown(divisor) in size. The others only accept 1.
+	virtual bool setDivisor(int divisor) {
+		return divisor == 1;
+	}
+
+	int divisor() const {
+		return scaleDivisor;
+	}
+
+	// Average time a full grab() takes, in milliseconds. 0 until measured.
+	double cost() const {
+		return frameCost;
+	}
+
+protected:
+	virtual bool doGrab() = 0;
+
+	// `r` is already clipped to the area. Backends that can't capture
+	// partially just grab everything.
+	virtual bool doGrabRect(const Rect& r) {
+		(void)r;
+		return doGrab();
+	}
+
+	// `rects` are already clipped to the area
+	virtual bool doGrabRects(const std::vector<Rect>& rects) {
+		bool ok = true;
+		for (const Rect& r : rects) {
+			ok = doGrabRect(r) && ok;
+		}
+		return ok;
+	}
+
+	Rect bounds{};
+	// see setDivisor
+	int scaleDivisor = 1;
+
+private:
+	double frameCost = 0.0;
+};
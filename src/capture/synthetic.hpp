@@ -0,0 +1,154 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include <string>
+#include <vector>
+
+#include <X11/Xlib.h>
+
+#include "region.hpp"
+#include "source.hpp"
+
+// Size of the squares synthetic and replayed frames change by
+const int SYNTHETIC_TILE = 64;
+
+// Reads "WxH" into `w` and `h`
+bool parseSize(const std::string& s, int& w, int& h) {
+	return std::sscanf(s.c_str(), "%dx%d", &w, &h) == 2 && w > 0 && h > 0;
+}
+
+// Generates an animated test pattern instead of capturing anything, so the
+// rest of the pipeline can be measured without a real desktop.
+//
+// Configured as "synthetic[:WxH[:RATE]]": every frame, RATE (0..1) of the
+// area is repainted in SYNTHETIC_TILE squares, spread over the screen in a
+// fixed order. The same settings always produce the same frames.
+class SyntheticSource : public CaptureSource {
+public:
+	explicit SyntheticSource(const std::string& spec) {
+		std::size_t a = spec.find(':');
+		if (a == std::string::npos) {
+			return;
+		}
+
+		std::size_t b = spec.find(':', a + 1);
+		valid = parseSize(spec.substr(a + 1, b - a - 1), width, height);
+		if (b != std::string::npos) {
+			rate = std::atof(spec.c_str() + b + 1);
+			valid = valid && rate >= 0.0 && rate <= 1.0;
+		}
+	}
+
+	const char* name() const override {
+		return "synthetic";
+	}
+
+	// Always uses its own size; `display` and `area` are ignored
+	bool open(Display* display, const Rect& area) override {
+		(void)display;
+		(void)area;
+
+		if (!valid) {
+			fprintf(stderr, "[ERROR] Expected synthetic[:WxH[:RATE]] with RATE between 0 and 1\n");
+			return false;
+		}
+
+		bounds = Rect{0, 0, width, height};
+		pixels.assign((std::size_t)width * height * 4, 0);
+		paint(bounds);
+		return true;
+	}
+
+	ImageView image() const override {
+		return ImageView{pixels.data(), width, height, width * 4};
+	}
+
+	bool pollDamage(DirtyRegion& out) override {
+		damageDriven = true;
+		advance(out);
+		return true;
+	}
+
+protected:
+	bool doGrab() override {
+		// Callers that track damage advance the animation through
+		// pollDamage, for everyone else each full grab is a new frame.
+		if (!damageDriven) {
+			DirtyRegion ignored;
+			advance(ignored);
+		}
+		return true;
+	}
+
+	bool doGrabRect(const Rect& r) override {
+		(void)r;
+		return true;
+	}
+
+private:
+	// Moves to the next frame and repaints what changed
+	void advance(DirtyRegion& out) {
+		frame++;
+
+		int cols = (width + SYNTHETIC_TILE - 1) / SYNTHETIC_TILE;
+		int rows = (height + SYNTHETIC_TILE - 1) / SYNTHETIC_TILE;
+		long tiles = (long)cols * rows;
+		long count = std::lround(rate * tiles);
+
+		if (count >= tiles) {
+			paint(bounds);
+			out.add(bounds);
+			return;
+		}
+
+		// walk the tiles with a stride coprime to their count, around the
+		// golden ratio of it, so that the changed tiles are spread out and
+		// consecutive frames touch different parts of the screen
+		long step = std::max(1L, (long)(tiles * 0.618));
+		while (std::gcd(step, tiles) != 1) {
+			step--;
+		}
+		for (long k = 0; k < count; k++) {
+			long t = (cursor + k * step) % tiles;
+			Rect r = Rect{
+				(int)(t % cols) * SYNTHETIC_TILE,
+				(int)(t / cols) * SYNTHETIC_TILE,
+				SYNTHETIC_TILE,
+				SYNTHETIC_TILE
+			}.intersect(bounds);
+
+			paint(r);
+			out.add(r);
+		}
+		cursor = (cursor + count * step) % tiles;
+	}
+
+	// Diagonal gradient that shifts with every frame
+	void paint(const Rect& r) {
+		for (int y = r.y; y < r.bottom(); y++) {
+			std::uint8_t* row = pixels.data() + ((std::size_t)y * width + r.x) * 4;
+			for (int x = r.x; x < r.right(); x++) {
+				*row++ = (std::uint8_t)(x + frame * 3);
+				*row++ = (std::uint8_t)(y + frame * 5);
+				*row++ = (std::uint8_t)((x ^ y) + frame * 7);
+				*row++ = 0xff;
+			}
+		}
+	}
+
+	int width = 1920;
+	int height = 1080;
+	double rate = 0.01;
+	bool valid = true;
+
+	std::vector<std::uint8_t> pixels;
+	std::uint64_t frame = 0;
+	long cursor = 0;
+	bool damageDriven = false;
+};
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TILE_HASH_X86
+#include <immintrin.h>
+#endif
+
+#include "region.hpp"
+#include "source.hpp"
+#include "tiles.hpp"
+
+// Lanes of a row hash, each taking every 8th 32-bit word of the row. All
+// kernels use the same lanes, so hashes don't depend on the CPU.
+const int HASH_LANES = 8;
+const std::uint32_t HASH_PRIME = 0x9e3779b1u;
+
+// A row kernel hashes as many whole 32-byte blocks of `bytes` as it can into
+// `lanes` and returns how many bytes that was; the scalar code does the rest.
+using HashRowKernel = std::size_t (*)(const std::uint8_t* data, std::size_t bytes, std::uint32_t* lanes);
+
+// Every lane is folded as (lane ^ word) * HASH_PRIME, which maps distinct
+// words to distinct lanes, so a single changed word always changes the hash.
+static void hashRowScalar(const std::uint8_t* data, std::size_t from, std::size_t bytes, std::uint32_t* lanes) {
+	std::size_t i = from;
+	for (; i + 32 <= bytes; i += 32) {
+		for (int l = 0; l < HASH_LANES; l++) {
+			std::uint32_t w;
+			std::memcpy(&w, data + i + l * 4, 4);
+			lanes[l] = (lanes[l] ^ w) * HASH_PRIME;
+		}
+	}
+
+	if (i < bytes) {
+		std::uint8_t tail[32] = {};
+		std::memcpy(tail, data + i, bytes - i);
+		for (int l = 0; l < HASH_LANES; l++) {
+			std::uint32_t w;
+			std::memcpy(&w, tail + l * 4, 4);
+			lanes[l] = (lanes[l] ^ w) * HASH_PRIME;
+		}
+	}
+}
+
+#ifdef TILE_HASH_X86
+// 32-bit multiplies need SSE4.1, SSE2 only multiplies every other lane
+__attribute__((target("sse4.1")))
+static std::size_t hashRowSse41(const std::uint8_t* data, std::size_t bytes, std::uint32_t* lanes) {
+	const __m128i prime = _mm_set1_epi32((int)HASH_PRIME);
+	__m128i lo = _mm_loadu_si128((const __m128i*)lanes);
+	__m128i hi = _mm_loadu_si128((const __m128i*)(lanes + 4));
+	std::size_t i = 0;
+	for (; i + 32 <= bytes; i += 32) {
+		lo = _mm_mullo_epi32(_mm_xor_si128(lo, _mm_loadu_si128((const __m128i*)(data + i))), prime);
+		hi = _mm_mullo_epi32(_mm_xor_si128(hi, _mm_loadu_si128((const __m128i*)(data + i + 16))), prime);
+	}
+	_mm_storeu_si128((__m128i*)lanes, lo);
+	_mm_storeu_si128((__m128i*)(lanes + 4), hi);
+	return i;
+}
+
+__attribute__((target("avx2")))
+static std::size_t hashRowAvx2(const std::uint8_t* data, std::size_t bytes, std::uint32_t* lanes) {
+	const __m256i prime = _mm256_set1_epi32((int)HASH_PRIME);
+	__m256i h = _mm256_loadu_si256((const __m256i*)lanes);
+	std::size_t i = 0;
+	for (; i + 32 <= bytes; i += 32) {
+		h = _mm256_mullo_epi32(_mm256_xor_si256(h, _mm256_loadu_si256((const __m256i*)(data + i))), prime);
+	}
+	_mm256_storeu_si256((__m256i*)lanes, h);
+	return i;
+}
+
+// Picks the widest kernel the CPU runs, once
+static HashRowKernel hashRowKernel() {
+	static const HashRowKernel kernel = __builtin_cpu_supports("avx2") ? hashRowAvx2
+		: __builtin_cpu_supports("sse4.1") ? hashRowSse41
+		: nullptr;
+	return kernel;
+}
+#else
+static HashRowKernel hashRowKernel() {
+	return nullptr;
+}
+#endif
+
+// Final mix of MurmurHash3, so that lanes differing in a few bits end up
+// differing everywhere before they are combined
+static std::uint64_t mixHash(std::uint64_t h) {
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+// Hashes the pixels of `img` under `r` (in image coordinates). Not meant to
+// resist anything, only to tell whether pixels changed between captures.
+std::uint64_t hashImageRect(const ImageView& img, const Rect& r) {
+	HashRowKernel kernel = hashRowKernel();
+	std::size_t bytes = (std::size_t)r.width * bytesPerPixel(img.format);
+
+	std::uint32_t lanes[HASH_LANES];
+	for (int l = 0; l < HASH_LANES; l++) {
+		lanes[l] = HASH_PRIME * (std::uint32_t)(l + 1);
+	}
+
+	for (int y = r.y; y < r.bottom(); y++) {
+		const std::uint8_t* row = img.data + (std::size_t)y * img.stride + (std::size_t)r.x * bytesPerPixel(img.format);
+		std::size_t done = kernel ? kernel(row, bytes, lanes) : 0;
+		hashRowScalar(row, done, bytes, lanes);
+	}
+
+	std::uint64_t h = mixHash(((std::uint64_t)r.width << 32) | (std::uint32_t)r.height);
+	for (int l = 0; l < HASH_LANES; l++) {
+		h = mixHash(h ^ lanes[l]);
+	}
+	return h;
+}
+
+// Hashes of the tiles of a TileClock, for telling which of them changed
+// when nothing reports damage. 0 stands for a tile never hashed.
+struct TileHashes {
+	int width = 0;
+	int height = 0;
+	std::vector<std::uint64_t> hashes;
+};
+
+void resetTileHashes(TileHashes& th, const TileClock& tc) {
+	th.width = tc.width;
+	th.height = tc.height;
+	th.hashes.assign(tc.times.size(), 0);
+}
+
+// Hashes every tile `captured` touches, as it is now in `sources` (each
+// holding 1/divisor of its area, see CaptureSource::setDivisor), and returns
+// the parts of `captured` lying on tiles whose hash changed. Pixels of a
+// tile outside `captured` are what they were, so only `captured` can hold
+// the change.
+DirtyRegion changedTiles(TileHashes& th, const TileClock& tc, const DirtyRegion& captured,
+	const std::vector<std::unique_ptr<CaptureSource>>& sources, int divisor)
+{
+	std::vector<bool> hashed(th.hashes.size(), false);
+	std::vector<bool> changed(th.hashes.size(), false);
+
+	for (const Rect& r : captured.rects()) {
+		forEachTile(tc, r, [&](std::size_t i, const Rect& tile) {
+			if (hashed[i]) {
+				return;
+			}
+			hashed[i] = true;
+
+			// tiles on several outputs get one hash of all their parts
+			std::uint64_t h = 0;
+			for (const auto& src : sources) {
+				Rect part = tile.intersect(src->area());
+				if (part.empty()) {
+					continue;
+				}
+				Rect area = src->area().scaledDown(divisor);
+				part = part.scaledDown(divisor).intersect(area);
+				h = mixHash(h ^ hashImageRect(src->image(), Rect{part.x - area.x, part.y - area.y, part.width, part.height}));
+			}
+
+			h = h ? h : 1;
+			changed[i] = th.hashes[i] != h;
+			th.hashes[i] = h;
+		});
+	}
+
+	DirtyRegion out;
+	for (const Rect& r : captured.rects()) {
+		forEachTile(tc, r, [&](std::size_t i, const Rect& tile) {
+			if (changed[i]) {
+				out.add(r.intersect(tile));
+			}
+		});
+	}
+	return out;
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "region.hpp"
+
+// Side of the tiles live capture keeps timestamps for
+const int CAPTURE_TILE_SIZE = 128;
+// How often parts of the screen away from the viewport and the pointer are
+// refreshed at most, in Hz
+const float PERIPHERY_RATE = 4.0f;
+
+// When each tile of the screen was last captured. Tiles never captured hold
+// the clock's epoch.
+struct TileClock {
+	// size of the screen the tiles cover
+	int width = 0;
+	int height = 0;
+	int cols = 0;
+	int rows = 0;
+	// row by row
+	std::vector<std::chrono::steady_clock::time_point> times;
+};
+
+void resetTileClock(TileClock& tc, int width, int height) {
+	tc.width = width;
+	tc.height = height;
+	tc.cols = (width + CAPTURE_TILE_SIZE - 1) / CAPTURE_TILE_SIZE;
+	tc.rows = (height + CAPTURE_TILE_SIZE - 1) / CAPTURE_TILE_SIZE;
+	tc.times.assign((std::size_t)tc.cols * tc.rows, std::chrono::steady_clock::time_point{});
+}
+
+Rect tileRect(const TileClock& tc, int col, int row) {
+	Rect r{col * CAPTURE_TILE_SIZE, row * CAPTURE_TILE_SIZE, CAPTURE_TILE_SIZE, CAPTURE_TILE_SIZE};
+	return r.intersect(Rect{0, 0, tc.width, tc.height});
+}
+
+// Calls fn(index, tile) for every tile overlapping `r`
+template <typename F>
+void forEachTile(const TileClock& tc, const Rect& r, F fn) {
+	Rect c = r.intersect(Rect{0, 0, tc.width, tc.height});
+	if (c.empty()) {
+		return;
+	}
+
+	for (int row = c.y / CAPTURE_TILE_SIZE; row <= (c.bottom() - 1) / CAPTURE_TILE_SIZE; row++) {
+		for (int col = c.x / CAPTURE_TILE_SIZE; col <= (c.right() - 1) / CAPTURE_TILE_SIZE; col++) {
+			fn((std::size_t)row * tc.cols + col, tileRect(tc, col, row));
+		}
+	}
+}
+
+// Stamps the tiles `captured` brings up to date with `time`. When the screen
+// reports damage, pixels of a tile that weren't damaged are current anyway,
+// so any tile touched by `captured` and left without damage in `stale`
+// counts. Without damage, only tiles `captured` covers whole do.
+void stampTiles(TileClock& tc, const DirtyRegion& captured, const DirtyRegion* stale,
+	std::chrono::steady_clock::time_point time)
+{
+	std::vector<std::int64_t> covered(tc.times.size(), 0);
+	for (const Rect& r : captured.rects()) {
+		forEachTile(tc, r, [&](std::size_t i, const Rect& tile) {
+			covered[i] += r.intersect(tile).area();
+		});
+	}
+
+	for (int row = 0; row < tc.rows; row++) {
+		for (int col = 0; col < tc.cols; col++) {
+			std::size_t i = (std::size_t)row * tc.cols + col;
+			Rect tile = tileRect(tc, col, row);
+
+			bool current;
+			if (stale) {
+				current = covered[i] > 0;
+				for (const Rect& r : stale->rects()) {
+					current = current && r.intersect(tile).empty();
+				}
+			}
+			else {
+				// rectangles can overlap a little, close enough
+				current = covered[i] >= tile.area();
+			}
+
+			if (current) {
+				tc.times[i] = time;
+			}
+		}
+	}
+}
+
+// The parts of `stale` lying on tiles last captured at or before `cutoff`
+DirtyRegion dueTiles(const TileClock& tc, const DirtyRegion& stale, std::chrono::steady_clock::time_point cutoff) {
+	DirtyRegion due;
+	for (const Rect& r : stale.rects()) {
+		forEachTile(tc, r, [&](std::size_t i, const Rect& tile) {
+			if (tc.times[i] <= cutoff) {
+				due.add(r.intersect(tile));
+			}
+		});
+	}
+	return due;
+}
+
+// The `share` (0 to 1) of the tiles not overlapping `skip` that were
+// captured the longest ago, at least one
+DirtyRegion oldestTiles(const TileClock& tc, const DirtyRegion& skip, float share) {
+	std::vector<std::size_t> candidates;
+	for (int row = 0; row < tc.rows; row++) {
+		for (int col = 0; col < tc.cols; col++) {
+			Rect tile = tileRect(tc, col, row);
+			bool skipped = false;
+			for (const Rect& r : skip.rects()) {
+				skipped = skipped || !r.intersect(tile).empty();
+			}
+			if (!skipped) {
+				candidates.push_back((std::size_t)row * tc.cols + col);
+			}
+		}
+	}
+
+	std::size_t count = std::min(candidates.size(),
+		(std::size_t)std::ceil(candidates.size() * std::clamp(share, 0.0f, 1.0f)));
+	count = std::min(candidates.size(), std::max<std::size_t>(count, 1));
+
+	std::partial_sort(candidates.begin(), candidates.begin() + count, candidates.end(),
+		[&](std::size_t a, std::size_t b) { return tc.times[a] < tc.times[b]; });
+
+	DirtyRegion out;
+	for (std::size_t k = 0; k < count; k++) {
+		std::size_t i = candidates[k];
+		out.add(tileRect(tc, (int)(i % tc.cols), (int)(i / tc.cols)));
+	}
+	return out;
+}
+
+// When the least recently captured tile overlapping `r` was captured
+std::chrono::steady_clock::time_point oldestTile(const TileClock& tc, const Rect& r) {
+	auto oldest = std::chrono::steady_clock::time_point::max();
+	forEachTile(tc, r, [&](std::size_t i, const Rect&) {
+		oldest = std::min(oldest, tc.times[i]);
+	});
+	return oldest;
+}
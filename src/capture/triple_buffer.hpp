@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Lock-free triple buffer for exactly one producer and one consumer thread.
+//
+// The producer owns back(), the consumer owns front(), and the third slot is
+// parked in between holding the most recently published value. Neither side
+// ever waits on the other: publishing swaps back() with the parked slot, and
+// consuming swaps front() with it if something new was published.
+template<typename T>
+class TripleBuffer {
+public:
+	// Slot the producer is free to write into.
+	T& back() {
+		return slots[backIndex];
+	}
+
+	// Hands back() over to the consumer. Returns true if the value that was
+	// parked before has never been consumed, i.e. a frame got dropped. In
+	// that case the dropped value is what back() refers to afterwards.
+	bool publish() {
+		std::uint8_t prev = middle.exchange(backIndex | FRESH_BIT, std::memory_order_acq_rel);
+		backIndex = prev & INDEX_MASK;
+		return (prev & FRESH_BIT) != 0;
+	}
+
+	// Takes the latest published value if there is one. front() stays valid
+	// until the next successful call.
+	bool consume() {
+		if (!(middle.load(std::memory_order_relaxed) & FRESH_BIT)) {
+			return false;
+		}
+
+		std::uint8_t prev = middle.exchange(frontIndex, std::memory_order_acq_rel);
+		frontIndex = prev & INDEX_MASK;
+		return true;
+	}
+
+	// Slot the consumer is free to read from.
+	T& front() {
+		return slots[frontIndex];
+	}
+
+private:
+	static constexpr std::uint8_t INDEX_MASK = 0x3;
+	static constexpr std::uint8_t FRESH_BIT = 0x4;
+
+	T slots[3];
+	std::uint8_t backIndex = 0;
+	std::uint8_t frontIndex = 1;
+	std::atomic<std::uint8_t> middle{2};
+};
@@ -0,0 +1,489 @@
+#pragma once
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <wayland-client.h>
+#include "wlr-screencopy-unstable-v1-client-protocol.h"
+
+#include "layout.hpp"
+#include "region.hpp"
+
+enum class FrameState {
+	Idle,
+	// requested, the compositor hasn't answered yet
+	Pending,
+	// the buffer holds a new frame that hasn't been picked up
+	Ready,
+	Failed,
+};
+
+// A monitor and the shm buffer its frames are copied into
+struct WaylandOutput {
+	struct WaylandCapture* owner;
+	wl_output* output;
+	// registry name, also used as Output::id
+	std::uint32_t name;
+	// position in the compositor's global space
+	int x;
+	int y;
+	// in mHz
+	int refresh;
+
+	zwlr_screencopy_frame_v1* frame;
+	FrameState state;
+	bool withDamage;
+	// set when the frame's rows are stored bottom first
+	bool yInverted;
+	// what changed in the last frame, in buffer coordinates. Only reported
+	// for frames requested with damage.
+	DirtyRegion damage;
+
+	// buffer the compositor offered for the current frame
+	std::uint32_t format;
+	int width;
+	int height;
+	int stride;
+	bool offered;
+
+	wl_buffer* buffer;
+	std::uint8_t* pixels;
+	std::size_t size;
+};
+
+// Captures every output of a wlroots-based compositor through the
+// wlr-screencopy protocol, over a connection of its own.
+//
+// The compositor copies each output into a shared memory buffer while we
+// carry on; frames are requested, and picked up once they are Ready. When
+// requested with damage, the compositor only answers once something changed
+// and says what did, so live mode only uploads changed regions.
+struct WaylandCapture {
+	wl_display* display;
+	wl_registry* registry;
+	wl_shm* shm;
+	zwlr_screencopy_manager_v1* manager;
+	std::uint32_t managerVersion;
+	// pointers stay valid as outputs come and go, listeners hold them
+	std::vector<std::unique_ptr<WaylandOutput>> outputs;
+	// set when outputs were added, removed or resized, cleared by the owner
+	// after re-reading the layout
+	bool layoutDirty;
+};
+
+// 32bpp formats whose bytes are B, G, R, A/X in memory, like every other
+// backend's
+static bool isWaylandBGRA(std::uint32_t format) {
+	return format == WL_SHM_FORMAT_ARGB8888 || format == WL_SHM_FORMAT_XRGB8888;
+}
+
+static void destroyWaylandBuffer(WaylandOutput& out) {
+	if (!out.buffer) {
+		return;
+	}
+	wl_buffer_destroy(out.buffer);
+	munmap(out.pixels, out.size);
+	out.buffer = nullptr;
+	out.pixels = nullptr;
+	out.size = 0;
+}
+
+// (Re)allocates the buffer to match what the compositor offered. Returns
+// true if it had to, in which case the buffer holds no pixels yet.
+static bool fitWaylandBuffer(WaylandOutput& out) {
+	std::size_t size = (std::size_t)out.stride * out.height;
+	if (out.buffer && size == out.size) {
+		return false;
+	}
+	destroyWaylandBuffer(out);
+
+	int fd = memfd_create("clearview-screencopy", MFD_CLOEXEC);
+	if (fd < 0 || ftruncate(fd, (off_t)size) < 0) {
+		fprintf(stderr, "[ERROR] Couldn't allocate a %zu byte screencopy buffer\n", size);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return false;
+	}
+
+	void* pixels = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (pixels == MAP_FAILED) {
+		fprintf(stderr, "[ERROR] Couldn't map the screencopy buffer\n");
+		close(fd);
+		return false;
+	}
+
+	wl_shm_pool* pool = wl_shm_create_pool(out.owner->shm, fd, (std::int32_t)size);
+	out.buffer = wl_shm_pool_create_buffer(pool, 0, out.width, out.height, out.stride, out.format);
+	wl_shm_pool_destroy(pool);
+	close(fd);
+
+	out.pixels = (std::uint8_t*)pixels;
+	out.size = size;
+	return true;
+}
+
+static void finishWaylandFrame(WaylandOutput& out, FrameState state) {
+	zwlr_screencopy_frame_v1_destroy(out.frame);
+	out.frame = nullptr;
+	out.state = state;
+}
+
+// Every buffer type has been offered, copy into ours
+static void startWaylandCopy(WaylandOutput& out) {
+	if (!out.offered) {
+		fprintf(stderr, "[ERROR] The compositor offers no 32bpp shm buffer for output %u\n", out.name);
+		finishWaylandFrame(out, FrameState::Failed);
+		return;
+	}
+
+	if (fitWaylandBuffer(out)) {
+		out.owner->layoutDirty = true;
+		// nothing to diff against, the whole buffer is new
+		out.damage.add(Rect{0, 0, out.width, out.height});
+	}
+	if (!out.buffer) {
+		finishWaylandFrame(out, FrameState::Failed);
+		return;
+	}
+
+	if (out.withDamage && out.owner->managerVersion >= 2) {
+		zwlr_screencopy_frame_v1_copy_with_damage(out.frame, out.buffer);
+	}
+	else {
+		zwlr_screencopy_frame_v1_copy(out.frame, out.buffer);
+	}
+}
+
+static void onFrameBuffer(void* data, zwlr_screencopy_frame_v1* frame,
+		std::uint32_t format, std::uint32_t width, std::uint32_t height, std::uint32_t stride) {
+	(void)frame;
+	WaylandOutput& out = *(WaylandOutput*)data;
+
+	if (isWaylandBGRA(format)) {
+		out.format = format;
+		out.width = (int)width;
+		out.height = (int)height;
+		out.stride = (int)stride;
+		out.offered = true;
+	}
+
+	// before version 3 there is only ever a single buffer event
+	if (out.owner->managerVersion < 3) {
+		startWaylandCopy(out);
+	}
+}
+
+static void onFrameFlags(void* data, zwlr_screencopy_frame_v1* frame, std::uint32_t flags) {
+	(void)frame;
+	WaylandOutput& out = *(WaylandOutput*)data;
+	out.yInverted = (flags & ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT) != 0;
+}
+
+static void onFrameReady(void* data, zwlr_screencopy_frame_v1* frame,
+		std::uint32_t secHi, std::uint32_t secLo, std::uint32_t nsec) {
+	(void)frame;
+	(void)secHi;
+	(void)secLo;
+	(void)nsec;
+	finishWaylandFrame(*(WaylandOutput*)data, FrameState::Ready);
+}
+
+static void onFrameFailed(void* data, zwlr_screencopy_frame_v1* frame) {
+	(void)frame;
+	finishWaylandFrame(*(WaylandOutput*)data, FrameState::Failed);
+}
+
+static void onFrameDamage(void* data, zwlr_screencopy_frame_v1* frame,
+		std::uint32_t x, std::uint32_t y, std::uint32_t width, std::uint32_t height) {
+	(void)frame;
+	WaylandOutput& out = *(WaylandOutput*)data;
+	out.damage.add(Rect{(int)x, (int)y, (int)width, (int)height});
+}
+
+static void onFrameDmabuf(void* data, zwlr_screencopy_frame_v1* frame,
+		std::uint32_t format, std::uint32_t width, std::uint32_t height) {
+	// only shm buffers are used
+	(void)data;
+	(void)frame;
+	(void)format;
+	(void)width;
+	(void)height;
+}
+
+static void onFrameBufferDone(void* data, zwlr_screencopy_frame_v1* frame) {
+	(void)frame;
+	startWaylandCopy(*(WaylandOutput*)data);
+}
+
+static const zwlr_screencopy_frame_v1_listener frameListener = {
+	onFrameBuffer,
+	onFrameFlags,
+	onFrameReady,
+	onFrameFailed,
+	onFrameDamage,
+	onFrameDmabuf,
+	onFrameBufferDone,
+};
+
+static void onOutputGeometry(void* data, wl_output* output, std::int32_t x, std::int32_t y,
+		std::int32_t physWidth, std::int32_t physHeight, std::int32_t subpixel,
+		const char* make, const char* model, std::int32_t transform) {
+	(void)output;
+	(void)physWidth;
+	(void)physHeight;
+	(void)subpixel;
+	(void)make;
+	(void)model;
+	(void)transform;
+
+	WaylandOutput& out = *(WaylandOutput*)data;
+	out.x = x;
+	out.y = y;
+	out.owner->layoutDirty = true;
+}
+
+static void onOutputMode(void* data, wl_output* output, std::uint32_t flags,
+		std::int32_t width, std::int32_t height, std::int32_t refresh) {
+	(void)output;
+	(void)width;
+	(void)height;
+
+	WaylandOutput& out = *(WaylandOutput*)data;
+	if (flags & WL_OUTPUT_MODE_CURRENT) {
+		out.refresh = refresh;
+	}
+}
+
+static void onOutputDone(void* data, wl_output* output) {
+	(void)data;
+	(void)output;
+}
+
+static void onOutputScale(void* data, wl_output* output, std::int32_t factor) {
+	(void)data;
+	(void)output;
+	(void)factor;
+}
+
+static const wl_output_listener outputListener = {
+	onOutputGeometry,
+	onOutputMode,
+	onOutputDone,
+	onOutputScale,
+};
+
+static void destroyWaylandOutput(WaylandOutput& out) {
+	if (out.frame) {
+		zwlr_screencopy_frame_v1_destroy(out.frame);
+		out.frame = nullptr;
+	}
+	destroyWaylandBuffer(out);
+	wl_output_destroy(out.output);
+}
+
+static void onRegistryGlobal(void* data, wl_registry* registry, std::uint32_t name,
+		const char* interface, std::uint32_t version) {
+	WaylandCapture& wc = *(WaylandCapture*)data;
+
+	if (std::strcmp(interface, wl_output_interface.name) == 0) {
+		auto out = std::make_unique<WaylandOutput>();
+		out->owner = &wc;
+		out->name = name;
+		out->output = (wl_output*)wl_registry_bind(registry, name, &wl_output_interface, std::min(version, 2u));
+		wl_output_add_listener(out->output, &outputListener, out.get());
+		wc.outputs.push_back(std::move(out));
+		wc.layoutDirty = true;
+	}
+	else if (std::strcmp(interface, wl_shm_interface.name) == 0) {
+		wc.shm = (wl_shm*)wl_registry_bind(registry, name, &wl_shm_interface, 1);
+	}
+	else if (std::strcmp(interface, zwlr_screencopy_manager_v1_interface.name) == 0) {
+		wc.managerVersion = std::min(version, 3u);
+		wc.manager = (zwlr_screencopy_manager_v1*)wl_registry_bind(registry, name,
+			&zwlr_screencopy_manager_v1_interface, wc.managerVersion);
+	}
+}
+
+static void onRegistryGlobalRemove(void* data, wl_registry* registry, std::uint32_t name) {
+	(void)registry;
+	WaylandCapture& wc = *(WaylandCapture*)data;
+
+	for (std::size_t i = 0; i < wc.outputs.size(); i++) {
+		if (wc.outputs[i]->name == name) {
+			destroyWaylandOutput(*wc.outputs[i]);
+			wc.outputs.erase(wc.outputs.begin() + i);
+			wc.layoutDirty = true;
+			return;
+		}
+	}
+}
+
+static const wl_registry_listener registryListener = {
+	onRegistryGlobal,
+	onRegistryGlobalRemove,
+};
+
+// Returns false if there is no compositor, or it doesn't implement
+// wlr-screencopy (e.g. GNOME and KDE).
+bool initWaylandCapture(WaylandCapture& wc) {
+	wc = WaylandCapture{};
+
+	wc.display = wl_display_connect(nullptr);
+	if (!wc.display) {
+		fprintf(stderr, "[ERROR] Couldn't connect to the Wayland compositor!\n");
+		return false;
+	}
+
+	wc.registry = wl_display_get_registry(wc.display);
+	wl_registry_add_listener(wc.registry, &registryListener, &wc);
+
+	// once for the globals, once more for the outputs' descriptions
+	wl_display_roundtrip(wc.display);
+	wl_display_roundtrip(wc.display);
+
+	if (!wc.manager) {
+		fprintf(stderr, "[ERROR] The compositor doesn't support wlr-screencopy\n");
+		return false;
+	}
+	if (!wc.shm) {
+		fprintf(stderr, "[ERROR] The compositor doesn't support wl_shm\n");
+		return false;
+	}
+	if (wc.outputs.empty()) {
+		fprintf(stderr, "[ERROR] The compositor has no outputs\n");
+		return false;
+	}
+	return true;
+}
+
+void destroyWaylandCapture(WaylandCapture& wc) {
+	for (auto& out : wc.outputs) {
+		destroyWaylandOutput(*out);
+	}
+	wc.outputs.clear();
+
+	if (wc.manager) {
+		zwlr_screencopy_manager_v1_destroy(wc.manager);
+	}
+	if (wc.shm) {
+		wl_shm_destroy(wc.shm);
+	}
+	if (wc.registry) {
+		wl_registry_destroy(wc.registry);
+	}
+	if (wc.display) {
+		wl_display_disconnect(wc.display);
+	}
+	wc = WaylandCapture{};
+}
+
+// Asks for the next frame of `out`. With `withDamage`, the compositor waits
+// until something changed and reports what. Does nothing if a frame is
+// already on its way.
+void requestWaylandFrame(WaylandCapture& wc, WaylandOutput& out, bool withDamage) {
+	if (out.state == FrameState::Pending) {
+		return;
+	}
+
+	out.damage.clear();
+	out.offered = false;
+	out.withDamage = withDamage;
+	out.state = FrameState::Pending;
+	out.frame = zwlr_screencopy_manager_v1_capture_output(wc.manager, 0, out.output);
+	zwlr_screencopy_frame_v1_add_listener(out.frame, &frameListener, &out);
+	wl_display_flush(wc.display);
+}
+
+// Handles whatever the compositor sent so far, without waiting
+void dispatchWaylandCapture(WaylandCapture& wc) {
+	while (wl_display_prepare_read(wc.display) != 0) {
+		wl_display_dispatch_pending(wc.display);
+	}
+	wl_display_flush(wc.display);
+
+	pollfd pfd{wl_display_get_fd(wc.display), POLLIN, 0};
+	if (poll(&pfd, 1, 0) > 0) {
+		wl_display_read_events(wc.display);
+	}
+	else {
+		wl_display_cancel_read(wc.display);
+	}
+	wl_display_dispatch_pending(wc.display);
+}
+
+// Captures every output once, waiting for all of them. Returns false if none
+// could be captured.
+bool captureWaylandOutputs(WaylandCapture& wc) {
+	for (auto& out : wc.outputs) {
+		requestWaylandFrame(wc, *out, false);
+	}
+
+	auto pending = [&]() {
+		for (const auto& out : wc.outputs) {
+			if (out->state == FrameState::Pending) {
+				return true;
+			}
+		}
+		return false;
+	};
+	while (pending() && wl_display_dispatch(wc.display) >= 0) {
+	}
+
+	bool any = false;
+	for (const auto& out : wc.outputs) {
+		any = any || out->state == FrameState::Ready;
+	}
+	return any;
+}
+
+WaylandOutput* findWaylandOutput(WaylandCapture& wc, unsigned long id) {
+	for (auto& out : wc.outputs) {
+		if (out->name == id) {
+			return out.get();
+		}
+	}
+	return nullptr;
+}
+
+// Layout of every output captured at least once, moved so that it starts at
+// 0,0, and the size of its bounding box.
+//
+// Outputs are placed at their logical position but sized in buffer pixels,
+// so outputs scaled by the compositor may overlap, and rotated outputs show
+// up in their buffer's orientation rather than upright.
+std::vector<Output> waylandLayout(const WaylandCapture& wc, int& width, int& height) {
+	std::vector<Output> layout;
+	int minX = INT_MAX;
+	int minY = INT_MAX;
+	for (const auto& out : wc.outputs) {
+		if (out->buffer) {
+			minX = std::min(minX, out->x);
+			minY = std::min(minY, out->y);
+		}
+	}
+
+	width = 0;
+	height = 0;
+	for (const auto& out : wc.outputs) {
+		if (!out->buffer) {
+			continue;
+		}
+
+		Rect bounds{out->x - minX, out->y - minY, out->width, out->height};
+		layout.push_back(Output{out->name, bounds});
+		width = std::max(width, bounds.right());
+		height = std::max(height, bounds.bottom());
+	}
+	return layout;
+}
@@ -0,0 +1,422 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/cursorfont.h>
+#include <X11/extensions/Xcomposite.h>
+
+#include "region.hpp"
+#include "source.hpp"
+#include "shm.hpp"
+#include "xlib.hpp"
+
+#ifdef CAPTURE_XDAMAGE
+#include "damage.hpp"
+#endif
+
+// The window being captured belongs to someone else and can be destroyed at
+// any time, so requests about it are made with X errors trapped.
+static void trapWindowErrors(Display* display) {
+	trapXErrors(display);
+}
+
+// Returns false if anything since trapWindowErrors failed
+static bool untrapWindowErrors(Display* display) {
+	return untrapXErrors(display) == 0;
+}
+
+// The window focused according to the window manager, or None if it doesn't
+// say (not every window manager implements _NET_ACTIVE_WINDOW)
+Window activeWindow(Display* display) {
+	Atom prop = XInternAtom(display, "_NET_ACTIVE_WINDOW", True);
+	if (prop == None) {
+		return None;
+	}
+
+	Atom type;
+	int format;
+	unsigned long count, after;
+	unsigned char* data = nullptr;
+	Window window = None;
+
+	if (XGetWindowProperty(display, DefaultRootWindow(display), prop, 0, 1, False, XA_WINDOW,
+			&type, &format, &count, &after, &data) == Success && data) {
+		if (type == XA_WINDOW && format == 32 && count == 1) {
+			// format 32 properties come back as longs
+			window = (Window)*(unsigned long*)data;
+		}
+		XFree(data);
+	}
+	return window;
+}
+
+// Window managers reparent applications into decoration frames; this finds
+// the application window inside `frame`, i.e. the first one with WM_STATE.
+// Falls back to `frame` itself.
+Window clientWindow(Display* display, Window frame) {
+	Atom wmState = XInternAtom(display, "WM_STATE", True);
+	if (wmState == None) {
+		return frame;
+	}
+
+	std::vector<Window> queue{frame};
+	for (std::size_t i = 0; i < queue.size(); i++) {
+		Atom type = None;
+		int format;
+		unsigned long count, after;
+		unsigned char* data = nullptr;
+		if (XGetWindowProperty(display, queue[i], wmState, 0, 0, False, AnyPropertyType,
+				&type, &format, &count, &after, &data) == Success) {
+			if (data) {
+				XFree(data);
+			}
+			if (type != None) {
+				return queue[i];
+			}
+		}
+
+		Window root, parent;
+		Window* children = nullptr;
+		unsigned int n = 0;
+		if (XQueryTree(display, queue[i], &root, &parent, &children, &n)) {
+			queue.insert(queue.end(), children, children + n);
+			if (children) {
+				XFree(children);
+			}
+		}
+	}
+	return frame;
+}
+
+// Grabs the pointer until the user clicks on a window and returns it, or
+// None if they clicked the desktop or the pointer is grabbed by someone else.
+Window pickWindow(Display* display) {
+	Window root = DefaultRootWindow(display);
+	Cursor cursor = XCreateFontCursor(display, XC_crosshair);
+
+	if (XGrabPointer(display, root, False, ButtonPressMask, GrabModeAsync, GrabModeAsync,
+			root, cursor, CurrentTime) != GrabSuccess) {
+		fprintf(stderr, "[ERROR] Couldn't grab the pointer to pick a window\n");
+		XFreeCursor(display, cursor);
+		return None;
+	}
+
+	printf("[INFO] Click on the window to capture\n");
+
+	XEvent ev;
+	XMaskEvent(display, ButtonPressMask, &ev);
+
+	XUngrabPointer(display, CurrentTime);
+	XFreeCursor(display, cursor);
+	XFlush(display);
+
+	if (ev.xbutton.subwindow == None) {
+		return None;
+	}
+	return clientWindow(display, ev.xbutton.subwindow);
+}
+
+// Turns "window", "window:active" or "window:click" into "window:0xID" for
+// the window they designate, so that every connection opened afterwards
+// captures the same one. Returns an empty string if there is no such window.
+std::string resolveWindowSpec(Display* display, const std::string& spec) {
+	std::size_t colon = spec.find(':');
+	std::string how = colon == std::string::npos ? "active" : spec.substr(colon + 1);
+
+	Window window = None;
+	if (how == "active") {
+		window = activeWindow(display);
+		if (window == None) {
+			fprintf(stderr, "[ERROR] The window manager doesn't report an active window, use window:click\n");
+			return "";
+		}
+	}
+	else if (how == "click") {
+		window = pickWindow(display);
+		if (window == None) {
+			fprintf(stderr, "[ERROR] No window was picked\n");
+			return "";
+		}
+	}
+	else {
+		window = (Window)std::strtoul(how.c_str(), nullptr, 0);
+		if (window == None) {
+			fprintf(stderr, "[ERROR] Expected window[:active|click|ID], got '%s'\n", spec.c_str());
+			return "";
+		}
+	}
+
+	char resolved[32];
+	std::snprintf(resolved, sizeof(resolved), "window:0x%lx", window);
+	return resolved;
+}
+
+// Captures a single window instead of the screen, through the Composite
+// extension.
+//
+// Configured as "window[:active|click|ID]". The window is redirected
+// off-screen, which makes the server keep its contents in a pixmap of its
+// own; capturing that pixmap gives the window's pixels even where other
+// windows cover it. The capture is sized to the window and follows it as it
+// is resized. Once the window is gone, its last contents stay on display.
+class WindowSource : public CaptureSource {
+public:
+	explicit WindowSource(const std::string& spec) : spec(spec) {}
+
+	~WindowSource() override {
+		close();
+	}
+
+	const char* name() const override {
+		return "window";
+	}
+
+	// Always uses the size of the window; `area` is ignored
+	bool open(Display* display, const Rect& area) override {
+		(void)area;
+		this->display = display;
+
+		int eventBase, errorBase;
+		int major = 0;
+		int minor = 2;
+		if (!XCompositeQueryExtension(display, &eventBase, &errorBase)
+			|| !XCompositeQueryVersion(display, &major, &minor)
+			|| (major == 0 && minor < 2)) {
+			fprintf(stderr, "[ERROR] Window capture needs Composite 0.2 or newer\n");
+			return false;
+		}
+
+		std::string resolved = resolveWindowSpec(display, spec);
+		if (resolved.empty()) {
+			return false;
+		}
+		window = (Window)std::strtoul(resolved.c_str() + resolved.find(':') + 1, nullptr, 0);
+
+		XWindowAttributes attrs;
+		trapWindowErrors(display);
+		Status ok = XGetWindowAttributes(display, window, &attrs);
+		if (!untrapWindowErrors(display) || !ok) {
+			fprintf(stderr, "[ERROR] Window 0x%lx doesn't exist\n", window);
+			return false;
+		}
+		if (attrs.map_state != IsViewable) {
+			fprintf(stderr, "[ERROR] Window 0x%lx isn't mapped\n", window);
+			return false;
+		}
+
+		visual = attrs.visual;
+		depth = attrs.depth;
+
+		// Automatic redirection leaves the window on screen as before;
+		// compositing window managers already redirect it, in which case
+		// this only keeps the pixmap around for us.
+		XCompositeRedirectWindow(display, window, CompositeRedirectAutomatic);
+		XSelectInput(display, window, StructureNotifyMask);
+		redirected = true;
+
+		if (!attach()) {
+			close();
+			return false;
+		}
+
+#ifdef CAPTURE_XDAMAGE
+		hasDamage = initDamageTracker(damage, display, window);
+#endif
+		printf("[INFO] Capturing window 0x%lx (%dx%d)\n", window, bounds.width, bounds.height);
+		return true;
+	}
+
+	ImageView image() const override {
+		return ImageView{
+			(const std::uint8_t*)cap.image->data,
+			cap.width,
+			cap.height,
+			cap.image->bytes_per_line,
+			cap.format
+		};
+	}
+
+	bool pollDamage(DirtyRegion& out) override {
+#ifdef CAPTURE_XDAMAGE
+		if (hasDamage) {
+			// damage is reported relative to the inside of the border, the
+			// pixmap includes it
+			DirtyRegion inside;
+			stamp = ChangeStamp{};
+			collectDamage(damage, inside, &stamp);
+			for (const Rect& r : inside.rects()) {
+				out.add(Rect{r.x + border, r.y + border, r.width, r.height});
+			}
+			return true;
+		}
+#else
+		(void)out;
+#endif
+		return false;
+	}
+
+	ChangeStamp damageStamp() const override {
+		return stamp;
+	}
+
+	void handleEvent(const XEvent& ev) override {
+#ifdef CAPTURE_XDAMAGE
+		if (hasDamage && handleDamageEvent(damage, ev)) {
+			return;
+		}
+#endif
+		if (ev.xany.window != window) {
+			return;
+		}
+
+		switch (ev.type) {
+		case ConfigureNotify:
+			// moving the window doesn't matter, only resizing does
+			if (ev.xconfigure.width + 2 * ev.xconfigure.border_width != bounds.width
+				|| ev.xconfigure.height + 2 * ev.xconfigure.border_width != bounds.height) {
+				stalePixmap = true;
+			}
+			break;
+		case MapNotify:
+			// the server allocates a new pixmap every time the window is mapped
+			mapped = true;
+			stalePixmap = true;
+			break;
+		case UnmapNotify:
+			mapped = false;
+			break;
+		case DestroyNotify:
+			fprintf(stderr, "[WARN] Captured window 0x%lx was destroyed\n", window);
+			gone = true;
+			break;
+		}
+	}
+
+	bool updateArea() override {
+		if (!stalePixmap || !mapped || gone) {
+			return false;
+		}
+		stalePixmap = false;
+
+		Rect old = bounds;
+		if (!attach()) {
+			fprintf(stderr, "[WARN] Lost track of window 0x%lx, keeping its last contents\n", window);
+			gone = true;
+			return false;
+		}
+		return bounds != old;
+	}
+
+protected:
+	bool doGrab() override {
+		// The pixmap outlives the window, so this keeps working (and keeps
+		// returning the last contents) after it is unmapped or destroyed.
+		return capture(cap);
+	}
+
+	bool doGrabRect(const Rect& r) override {
+		if (!cap.scratch && !scratchFailed) {
+			scratchFailed = !attachShmScratch(cap, (std::size_t)cap.image->bytes_per_line * cap.height / 2);
+		}
+		return captureRect(cap, r);
+	}
+
+#ifdef CAPTURE_SHM_FD
+	bool doGrabRects(const std::vector<Rect>& rects) override {
+		if (!cap.scratch && !scratchFailed) {
+			scratchFailed = !attachShmScratch(cap, (std::size_t)cap.image->bytes_per_line * cap.height / 2);
+		}
+		return captureRects(cap, rects);
+	}
+#endif
+
+private:
+	// Names the window's current pixmap and sets up capturing it, replacing
+	// the previous one only once that worked
+	bool attach() {
+		XWindowAttributes attrs;
+		trapWindowErrors(display);
+		Status ok = XGetWindowAttributes(display, window, &attrs);
+		Pixmap next = ok ? XCompositeNameWindowPixmap(display, window) : None;
+		if (!untrapWindowErrors(display) || !ok) {
+			if (next != None) {
+				XFreePixmap(display, next);
+			}
+			return false;
+		}
+
+		Rect area{0, 0, attrs.width + 2 * attrs.border_width, attrs.height + 2 * attrs.border_width};
+
+		ShmCapture nextCap{};
+		if (!initShmCapture(nextCap, display, next, visual, depth, area)) {
+			XFreePixmap(display, next);
+			return false;
+		}
+
+		detach();
+		cap = nextCap;
+		pixmap = next;
+		border = attrs.border_width;
+		bounds = area;
+		scratchFailed = false;
+		return true;
+	}
+
+	void detach() {
+		if (pixmap == None) {
+			return;
+		}
+		destroyShmCapture(cap);
+		XFreePixmap(display, pixmap);
+		pixmap = None;
+	}
+
+	void close() {
+#ifdef CAPTURE_XDAMAGE
+		if (hasDamage) {
+			trapWindowErrors(display);
+			destroyDamageTracker(damage);
+			untrapWindowErrors(display);
+			hasDamage = false;
+		}
+#endif
+		detach();
+
+		if (redirected) {
+			// harmless if the window is already gone
+			trapWindowErrors(display);
+			XCompositeUnredirectWindow(display, window, CompositeRedirectAutomatic);
+			XSelectInput(display, window, NoEventMask);
+			untrapWindowErrors(display);
+			redirected = false;
+		}
+	}
+
+	std::string spec;
+	Display* display = nullptr;
+	Window window = None;
+	Visual* visual = nullptr;
+	int depth = 0;
+	int border = 0;
+
+	Pixmap pixmap = None;
+	ShmCapture cap{};
+	bool scratchFailed = false;
+
+	bool redirected = false;
+	bool mapped = true;
+	bool stalePixmap = false;
+	bool gone = false;
+
+#ifdef CAPTURE_XDAMAGE
+	DamageTracker damage{};
+	bool hasDamage = false;
+#endif
+	// of the last pollDamage
+	ChangeStamp stamp{};
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+
+#include "region.hpp"
+#include "source.hpp"
+
+// Plain XGetImage backend. Every pixel travels over the X socket, so it is
+// slower than MIT-SHM, but it works with any server, remote ones included.
+class XGetImageSource : public CaptureSource {
+public:
+	const char* name() const override {
+		return "x11-getimage";
+	}
+
+	bool open(Display* display, const Rect& area) override {
+		this->display = display;
+		root = DefaultRootWindow(display);
+
+		// probe a single pixel to learn the server's pixel format
+		XImage* probe = XGetImage(display, root, area.x, area.y, 1, 1, AllPlanes, ZPixmap);
+		if (!probe) {
+			fprintf(stderr, "[WARN] XGetImage failed\n");
+			return false;
+		}
+
+		int bpp = probe->bits_per_pixel;
+		format = pixelFormatOf(probe);
+		XDestroyImage(probe);
+
+		if (format == PixelFormat::Unknown) {
+			fprintf(stderr, "[WARN] XGetImage: unsupported %d bpp visual\n", bpp);
+			return false;
+		}
+
+		bounds = area;
+		stride = area.width * bytesPerPixel(format);
+		pixels.assign((std::size_t)stride * area.height, 0);
+		return true;
+	}
+
+	ImageView image() const override {
+		return ImageView{pixels.data(), bounds.width, bounds.height, stride, format};
+	}
+
+protected:
+	bool doGrab() override {
+		return doGrabRect(bounds);
+	}
+
+	bool doGrabRect(const Rect& r) override {
+		XImage* img = XGetImage(display, root, r.x, r.y, r.width, r.height, AllPlanes, ZPixmap);
+		if (!img) {
+			return false;
+		}
+
+		int bpp = bytesPerPixel(format);
+		for (int row = 0; row < r.height; row++) {
+			std::memcpy(
+				pixels.data() + (std::size_t)(r.y - bounds.y + row) * stride + (std::size_t)(r.x - bounds.x) * bpp,
+				img->data + (std::size_t)row * img->bytes_per_line,
+				(std::size_t)r.width * bpp
+			);
+		}
+
+		XDestroyImage(img);
+		return true;
+	}
+
+private:
+	Display* display = nullptr;
+	Window root = 0;
+	std::vector<std::uint8_t> pixels;
+	int stride = 0;
+	PixelFormat format = PixelFormat::Unknown;
+};
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <X11/Xlib.h>
+
+// Xlib's default error handler exits the process, so a capture racing a
+// mode switch, or a window going away under it, would take clearview down
+// with it. This one logs the error and lets the request fail instead; the
+// capture code finds out through return values as usual, and retries.
+//
+// The handler is shared by every connection and thread, so code expecting
+// errors doesn't swap it out but traps them on its own connection, see
+// trapXErrors.
+static std::atomic<std::uint64_t> xErrorCount{0};
+
+// Errors trapped on one connection. A connection is only used by one
+// thread at a time, so its traps nest like the calls making them.
+struct XErrorTraps {
+	// serial of the first request the outermost trap covers
+	unsigned long first = 0;
+	std::uint64_t errors = 0;
+	// `errors` when each trap still open began
+	std::vector<std::uint64_t> open;
+};
+
+static std::mutex xTrapMutex;
+static std::unordered_map<Display*, XErrorTraps> xTraps;
+
+// Counts the error against a trap of its connection, if one covers it
+static bool trapXError(Display* display, const XErrorEvent* ev) {
+	std::lock_guard<std::mutex> lock(xTrapMutex);
+	auto it = xTraps.find(display);
+	if (it == xTraps.end() || it->second.open.empty() || ev->serial < it->second.first) {
+		return false;
+	}
+	it->second.errors++;
+	return true;
+}
+
+static int logXError(Display* display, XErrorEvent* ev) {
+	if (trapXError(display, ev)) {
+		return 0;
+	}
+
+	char text[128];
+	XGetErrorText(display, ev->error_code, text, sizeof(text));
+	fprintf(stderr, "[WARN] X error: %s (request %d.%d on 0x%lx)\n",
+		text, ev->request_code, ev->minor_code, ev->resourceid);
+	xErrorCount.fetch_add(1, std::memory_order_relaxed);
+	return 0;
+}
+
+// Xlib exits once this returns, there is no recovering from a lost
+// connection; at least say what happened
+static int logXIOError(Display* display) {
+	fprintf(stderr, "[ERROR] Lost the connection to X server %s\n", DisplayString(display));
+	return 0;
+}
+
+// Installs the handlers above for every connection of the process. Has to
+// be called before any thread other than the caller uses Xlib.
+void installXErrorHandlers() {
+	XSetErrorHandler(logXError);
+	XSetIOErrorHandler(logXIOError);
+}
+
+// X errors seen since startup, outside of code trapping its own
+std::uint64_t xErrors() {
+	return xErrorCount.load(std::memory_order_relaxed);
+}
+
+// Errors of the requests made on `display` from now on are counted until
+// untrapXErrors instead of being logged. Needs installXErrorHandlers.
+void trapXErrors(Display* display) {
+	std::lock_guard<std::mutex> lock(xTrapMutex);
+	XErrorTraps& traps = xTraps[display];
+	if (traps.open.empty()) {
+		traps.first = NextRequest(display);
+		traps.errors = 0;
+	}
+	traps.open.push_back(traps.errors);
+}
+
+// Waits for the requests made since the matching trapXErrors and returns
+// how many of them failed
+int untrapXErrors(Display* display) {
+	XSync(display, False);
+
+	std::lock_guard<std::mutex> lock(xTrapMutex);
+	XErrorTraps& traps = xTraps[display];
+	std::uint64_t before = traps.open.back();
+	traps.open.pop_back();
+	int errors = (int)(traps.errors - before);
+	if (traps.open.empty()) {
+		// connections come and go, e.g. with every banded capture
+		xTraps.erase(display);
+	}
+	return errors;
+}
+
+// Adds `mask` to the events this connection selected on `window`.
+// XSelectInput replaces the mask, which would silently drop events some
+// other part of the code selected on the same connection.
+void selectMoreInput(Display* display, Window window, long mask) {
+	XWindowAttributes attrs;
+	long current = XGetWindowAttributes(display, window, &attrs) ? attrs.your_event_mask : 0;
+	XSelectInput(display, window, current | mask);
+}
+
+// Takes `mask` back out of the events selected by selectMoreInput
+void selectLessInput(Display* display, Window window, long mask) {
+	XWindowAttributes attrs;
+	if (XGetWindowAttributes(display, window, &attrs)) {
+		XSelectInput(display, window, attrs.your_event_mask & ~mask);
+	}
+}
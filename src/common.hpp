@@ -60,6 +60,29 @@ Context ctx = Context{
     }
 };
 
+// Everything a drawn frame depends on besides the screen's pixels
+struct ViewState {
+    glm::vec2 cameraPosition;
+    float cameraScale;
+    glm::vec2 mouse;
+    glm::vec2 windowSize;
+    float flRadius;
+    float flShadow;
+
+    bool operator==(const ViewState&) const = default;
+};
+
+ViewState currentView() {
+    return ViewState{
+        ctx.camera.position,
+        ctx.camera.scale,
+        ctx.mouse.current,
+        ctx.windowSize,
+        ctx.fl.radius,
+        ctx.fl.shadow
+    };
+}
+
 void scrollCallback(GLFWwindow* window, double xoffset, double yoffset) {
     (void)xoffset;
     int ctrlState = glfwGetKey(window, GLFW_KEY_LEFT_CONTROL);
@@ -92,8 +115,8 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
             ctx.reset();
         }
         else if (key == GLFW_KEY_Q || key == GLFW_KEY_ESCAPE) {
+            // the render loop stops and cleans up after itself
             glfwSetWindowShouldClose(window, GLFW_TRUE);
-            exit(EXIT_SUCCESS);
         }
         else if (key == GLFW_KEY_F) {
             ctx.fl.isEnabled = !ctx.fl.isEnabled;
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include <glad/glad.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/Xfixes.h>
+
+#include "screen_textures.hpp"
+
+// Texture unit the cursor is sampled from, u_tex being on unit 0
+const int CURSOR_TEXTURE_UNIT = 1;
+
+// The pointer image, kept in a small texture of its own and drawn by the
+// fragment shader at u_cursorPos on top of the captured screen. Moving the
+// pointer then costs no capture at all; the image is only fetched again
+// when XFixes says the cursor changed.
+struct CursorOverlay {
+	Display* display;
+	int eventBase;
+	// set by a cursor change, cleared once the new image is uploaded
+	bool dirty;
+
+	GLuint texture;
+	int width;
+	int height;
+	int xhot;
+	int yhot;
+};
+
+// Returns false if the server lacks XFixes, in which case no cursor is drawn
+bool initCursorOverlay(CursorOverlay& co, Display* display, Window root) {
+	co = CursorOverlay{};
+	co.display = display;
+
+	int errorBase;
+	if (!XFixesQueryExtension(display, &co.eventBase, &errorBase)) {
+		fprintf(stderr, "[WARN] XFixes is not available, the cursor won't be drawn\n");
+		return false;
+	}
+
+	XFixesSelectCursorInput(display, root, XFixesDisplayCursorNotifyMask);
+	co.dirty = true;
+	return true;
+}
+
+void destroyCursorOverlay(CursorOverlay& co) {
+	if (co.texture) {
+		glDeleteTextures(1, &co.texture);
+		co.texture = 0;
+	}
+}
+
+// Returns true if `ev` was a cursor change. The owner of the connection has
+// to feed every event it reads through here.
+bool handleCursorEvent(CursorOverlay& co, const XEvent& ev) {
+	if (co.display && ev.type == co.eventBase + XFixesCursorNotify) {
+		co.dirty = true;
+		return true;
+	}
+	return false;
+}
+
+// Fetches and uploads the cursor image if it changed
+void refreshCursorOverlay(CursorOverlay& co) {
+	if (!co.dirty) {
+		return;
+	}
+	co.dirty = false;
+
+	XFixesCursorImage* img = XFixesGetCursorImage(co.display);
+	if (!img) {
+		return;
+	}
+
+	// premultiplied ARGB, one pixel per long whatever the size of a long
+	std::vector<std::uint32_t> pixels((std::size_t)img->width * img->height);
+	for (std::size_t i = 0; i < pixels.size(); i++) {
+		pixels[i] = (std::uint32_t)img->pixels[i];
+	}
+
+	if (!co.texture || img->width != co.width || img->height != co.height) {
+		destroyCursorOverlay(co);
+		co.texture = createScreenTexture(img->width, img->height);
+		co.width = img->width;
+		co.height = img->height;
+	}
+	co.xhot = img->xhot;
+	co.yhot = img->yhot;
+
+	glBindTexture(GL_TEXTURE_2D, co.texture);
+	glTexSubImage2D(GL_TEXTURE_2D,
+		0,
+		0, 0,
+		co.width,
+		co.height,
+		GL_BGRA,
+		GL_UNSIGNED_INT_8_8_8_8_REV,
+		pixels.data()
+	);
+
+	XFree(img);
+}
+
+// Hands the cursor to `program` for the next draw
+void bindCursorOverlay(CursorOverlay& co, GLuint program) {
+	glUseProgram(program);
+
+	glActiveTexture(GL_TEXTURE0 + CURSOR_TEXTURE_UNIT);
+	glBindTexture(GL_TEXTURE_2D, co.texture);
+	glActiveTexture(GL_TEXTURE0);
+
+	glUniform1i(glGetUniformLocation(program, "u_cursorTex"), CURSOR_TEXTURE_UNIT);
+	glUniform2f(glGetUniformLocation(program, "u_cursorSize"), (float)co.width, (float)co.height);
+	glUniform2f(glGetUniformLocation(program, "u_cursorHot"), (float)co.xhot, (float)co.yhot);
+}
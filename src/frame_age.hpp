@@ -0,0 +1,123 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+
+#include "capture/live.hpp"
+
+// Ages of a frame from the capture thread when it reached each stage of
+// the pipeline, counted from when its pixels were captured, in milliseconds
+struct FrameAge {
+	double converted;
+	double uploaded;
+	double presented;
+	// from when damage reported the change, if it did; negative otherwise
+	double sinceChange;
+	// X server time of the change, 0 if unknown
+	unsigned long serverTime;
+};
+
+// How old the pixels on screen are by the time they get there, for tuning
+// live mode for latency. Frames are followed from their capture through
+// conversion on the capture thread, upload and presentation. "Presented"
+// is when the buffer swap returned, which with vsync is about when the
+// frame was scanned out.
+struct FrameAges {
+	// uploaded and not presented yet
+	bool pending;
+	std::chrono::steady_clock::time_point captured;
+	std::chrono::steady_clock::time_point converted;
+	std::chrono::steady_clock::time_point uploaded;
+	ChangeStamp change;
+
+	// the last frame presented
+	FrameAge last;
+
+	// over the frames presented since the last resetFrameAges
+	std::uint64_t frames;
+	double presentedMs;
+	double maxPresentedMs;
+	std::uint64_t changes;
+	double sinceChangeMs;
+};
+
+static double ageMs(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to) {
+	return std::chrono::duration<double, std::milli>(to - from).count();
+}
+
+// Called once the patches of `frame` are uploaded. Frames uploaded before
+// the previous one was presented are shown together with it, and the
+// older stamps are kept.
+void frameUploaded(FrameAges& fa, const Frame& frame) {
+	if (!fa.pending || frame.captured < fa.captured) {
+		fa.captured = frame.captured;
+		fa.converted = frame.converted;
+	}
+	if (!fa.pending) {
+		fa.change = ChangeStamp{};
+	}
+	mergeChangeStamp(fa.change, frame.change);
+	fa.uploaded = std::chrono::steady_clock::now();
+	fa.pending = true;
+}
+
+// Called right after the buffer swap. Returns true if it showed a frame
+// from the capture thread, whose ages are then in `fa.last`.
+bool framePresented(FrameAges& fa) {
+	if (!fa.pending) {
+		return false;
+	}
+	fa.pending = false;
+
+	auto now = std::chrono::steady_clock::now();
+	fa.last = FrameAge{
+		ageMs(fa.captured, fa.converted),
+		ageMs(fa.captured, fa.uploaded),
+		ageMs(fa.captured, now),
+		hasChangeStamp(fa.change) ? ageMs(fa.change.seen, now) : -1.0,
+		fa.change.serverTime
+	};
+
+	fa.frames++;
+	fa.presentedMs += fa.last.presented;
+	fa.maxPresentedMs = std::max(fa.maxPresentedMs, fa.last.presented);
+	if (fa.last.sinceChange >= 0.0) {
+		fa.changes++;
+		fa.sinceChangeMs += fa.last.sinceChange;
+	}
+	return true;
+}
+
+void resetFrameAges(FrameAges& fa) {
+	fa.frames = 0;
+	fa.presentedMs = 0.0;
+	fa.maxPresentedMs = 0.0;
+	fa.changes = 0;
+	fa.sinceChangeMs = 0.0;
+}
+
+// Prints the ages of a single frame, one line per frame
+void printFrameAge(const FrameAge& age) {
+	printf("[INFO] Frame: converted %.2f ms, uploaded %.2f ms, presented %.2f ms after capture",
+		age.converted, age.uploaded, age.presented);
+	if (age.sinceChange >= 0.0) {
+		printf(", %.2f ms after the change at server time %lu", age.sinceChange, age.serverTime);
+	}
+	printf("\n");
+}
+
+// Prints the averages since the last resetFrameAges, if any frame was shown
+void printFrameAges(const FrameAges& fa) {
+	if (fa.frames == 0) {
+		return;
+	}
+
+	printf("[INFO] Frame age: %.1f ms from capture to screen on average, %.1f ms at most",
+		fa.presentedMs / fa.frames, fa.maxPresentedMs);
+	if (fa.changes > 0) {
+		printf(", %.1f ms from change to screen", fa.sinceChangeMs / fa.changes);
+	}
+	printf("\n");
+}
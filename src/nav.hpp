@@ -21,6 +21,13 @@ struct Camera {
 		return v / scale;
 	}
 
+	// True while update() is still zooming or gliding, or the user drags
+	bool animating(const Config& cfg, const Mouse& mouse) const {
+		return mouse.dragging
+			|| std::abs(deltaScale) > 0.5f
+			|| glm::length(velocity) > cfg.velocityThreshold;
+	}
+
 	void update(const Config& cfg, 
 		float dt, 
 		const Mouse& mouse, 
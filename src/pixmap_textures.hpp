@@ -0,0 +1,228 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <glad/glad.h>
+#include <X11/Xlib.h>
+#include <GL/glx.h>
+
+#include "capture/region.hpp"
+#include "screen_textures.hpp"
+
+// Name of the zero-copy path for --backend. It isn't a CaptureSource: the
+// pixels never reach our memory, so it lives on the render side.
+const char* const PIXMAP_BACKEND = "glx-pixmap";
+
+// Zero-copy capture through GLX_EXT_texture_from_pixmap.
+//
+// Every output gets a server-side pixmap that its ScreenTextures texture is
+// bound to. Capturing copies the root window into those pixmaps with
+// XCopyArea, which never leaves the server (or the GPU, with DRI3), and
+// rebinds them; nothing goes through shared memory or glTexSubImage2D.
+//
+// Everything happens on the GL context's own connection, since that is the
+// only one GLX pixmaps can be bound over.
+struct PixmapTextures {
+	Display* display;
+	GLXFBConfig config;
+	// whether textures bound from `config` have their first row at the top,
+	// see ScreenTextures::flipY
+	bool yInverted;
+	GC gc;
+	// what gets copied, the root window if None; e.g. a desktop assembled
+	// without our own window, which the root would show
+	Drawable source;
+	PFNGLXBINDTEXIMAGEEXTPROC bindTexImage;
+	PFNGLXRELEASETEXIMAGEEXTPROC releaseTexImage;
+
+	// one of each per output of the bound ScreenTextures
+	std::vector<Pixmap> pixmaps;
+	std::vector<GLXPixmap> glxPixmaps;
+};
+
+static bool hasGLXExtension(Display* display, int screen, const char* name) {
+	const char* exts = glXQueryExtensionsString(display, screen);
+	if (!exts) {
+		return false;
+	}
+
+	std::size_t len = std::strlen(name);
+	for (const char* p = std::strstr(exts, name); p; p = std::strstr(p + len, name)) {
+		if ((p == exts || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\0')) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Returns false if the driver can't bind pixmaps of the root window's depth
+// as textures, in which case the regular capture backends have to be used.
+bool initPixmapTextures(PixmapTextures& pt, Display* display) {
+	pt = PixmapTextures{};
+	pt.display = display;
+
+	int screen = DefaultScreen(display);
+	if (!hasGLXExtension(display, screen, "GLX_EXT_texture_from_pixmap")) {
+		fprintf(stderr, "[WARN] GLX_EXT_texture_from_pixmap is not available\n");
+		return false;
+	}
+
+	pt.bindTexImage = (PFNGLXBINDTEXIMAGEEXTPROC)glXGetProcAddress((const GLubyte*)"glXBindTexImageEXT");
+	pt.releaseTexImage = (PFNGLXRELEASETEXIMAGEEXTPROC)glXGetProcAddress((const GLubyte*)"glXReleaseTexImageEXT");
+	if (!pt.bindTexImage || !pt.releaseTexImage) {
+		fprintf(stderr, "[WARN] GLX_EXT_texture_from_pixmap entry points are missing\n");
+		return false;
+	}
+
+	const int attribs[] = {
+		GLX_DRAWABLE_TYPE, GLX_PIXMAP_BIT,
+		GLX_BIND_TO_TEXTURE_RGB_EXT, True,
+		GLX_BIND_TO_TEXTURE_TARGETS_EXT, GLX_TEXTURE_2D_BIT_EXT,
+		GLX_DOUBLEBUFFER, False,
+		None
+	};
+
+	int count = 0;
+	GLXFBConfig* configs = glXChooseFBConfig(display, screen, attribs, &count);
+
+	// the pixmaps have to match the root window's depth to be copied into;
+	// prefer configs whose textures are laid out like the rest of ours
+	int depth = DefaultDepth(display, screen);
+	bool found = false;
+	for (int i = 0; i < count; i++) {
+		XVisualInfo* vi = glXGetVisualFromFBConfig(display, configs[i]);
+		if (!vi) {
+			continue;
+		}
+		bool match = vi->depth == depth;
+		XFree(vi);
+		if (!match) {
+			continue;
+		}
+
+		int inverted = 0;
+		glXGetFBConfigAttrib(display, configs[i], GLX_Y_INVERTED_EXT, &inverted);
+		if (!found || (inverted == True && !pt.yInverted)) {
+			pt.config = configs[i];
+			pt.yInverted = inverted == True;
+			found = true;
+		}
+	}
+	if (configs) {
+		XFree(configs);
+	}
+
+	if (!found) {
+		fprintf(stderr, "[WARN] No GLX config can bind %d bit pixmaps as textures\n", depth);
+		return false;
+	}
+
+	// children have to be included, or we only get the root's background
+	XGCValues values{};
+	values.subwindow_mode = IncludeInferiors;
+	values.graphics_exposures = False;
+	pt.gc = XCreateGC(display, DefaultRootWindow(display), GCSubwindowMode | GCGraphicsExposures, &values);
+	return true;
+}
+
+// Unbinds and frees every pixmap. Must be called before the textures of the
+// bound ScreenTextures are reallocated or deleted.
+void releasePixmapTextures(PixmapTextures& pt, ScreenTextures& st) {
+	for (std::size_t i = 0; i < pt.glxPixmaps.size(); i++) {
+		glBindTexture(GL_TEXTURE_2D, st.textures[i]);
+		pt.releaseTexImage(pt.display, pt.glxPixmaps[i], GLX_FRONT_LEFT_EXT);
+		glXDestroyPixmap(pt.display, pt.glxPixmaps[i]);
+		XFreePixmap(pt.display, pt.pixmaps[i]);
+	}
+	pt.pixmaps.clear();
+	pt.glxPixmaps.clear();
+}
+
+// Copies the part of `region` (in root coordinates) of `pt.source` that
+// lies on each output into its pixmap, and rebinds the pixmaps that changed
+// so GL sees the new contents.
+void refreshPixmapTextures(PixmapTextures& pt, ScreenTextures& st, const DirtyRegion& region) {
+	Drawable source = pt.source != None ? pt.source : DefaultRootWindow(pt.display);
+	std::vector<bool> touched(pt.pixmaps.size(), false);
+
+	for (std::size_t i = 0; i < pt.pixmaps.size(); i++) {
+		const Rect& bounds = st.outputs[i].bounds;
+
+		for (const Rect& rect : region.rects()) {
+			Rect r = rect.intersect(bounds);
+			if (r.empty()) {
+				continue;
+			}
+
+			XCopyArea(pt.display, source, pt.pixmaps[i], pt.gc,
+				r.x, r.y, r.width, r.height,
+				r.x - bounds.x, r.y - bounds.y
+			);
+			touched[i] = true;
+		}
+	}
+
+	// direct rendering reads the pixmaps without going through the server,
+	// so the copies have to be done before rebinding
+	XSync(pt.display, False);
+
+	for (std::size_t i = 0; i < pt.pixmaps.size(); i++) {
+		if (!touched[i]) {
+			continue;
+		}
+
+		glBindTexture(GL_TEXTURE_2D, st.textures[i]);
+		pt.releaseTexImage(pt.display, pt.glxPixmaps[i], GLX_FRONT_LEFT_EXT);
+		pt.bindTexImage(pt.display, pt.glxPixmaps[i], GLX_FRONT_LEFT_EXT, nullptr);
+	}
+}
+
+// Gives every texture of `st` a pixmap of its own and fills them all.
+// Returns false, with nothing bound, if the server refuses. `st` should have
+// been set up with flipY = !pt.yInverted.
+bool bindPixmapTextures(PixmapTextures& pt, ScreenTextures& st) {
+	releasePixmapTextures(pt, st);
+
+	Window root = DefaultRootWindow(pt.display);
+	int depth = DefaultDepth(pt.display, DefaultScreen(pt.display));
+
+	const int attribs[] = {
+		GLX_TEXTURE_TARGET_EXT, GLX_TEXTURE_2D_EXT,
+		GLX_TEXTURE_FORMAT_EXT, GLX_TEXTURE_FORMAT_RGB_EXT,
+		None
+	};
+
+	for (std::size_t i = 0; i < st.outputs.size(); i++) {
+		const Rect& bounds = st.outputs[i].bounds;
+
+		Pixmap pixmap = XCreatePixmap(pt.display, root, bounds.width, bounds.height, depth);
+		GLXPixmap glxPixmap = glXCreatePixmap(pt.display, pt.config, pixmap, attribs);
+		if (!glxPixmap) {
+			fprintf(stderr, "[WARN] Couldn't create a GLX pixmap for the output at %d,%d\n", bounds.x, bounds.y);
+			XFreePixmap(pt.display, pixmap);
+			releasePixmapTextures(pt, st);
+			return false;
+		}
+
+		glBindTexture(GL_TEXTURE_2D, st.textures[i]);
+		pt.bindTexImage(pt.display, glxPixmap, GLX_FRONT_LEFT_EXT, nullptr);
+
+		pt.pixmaps.push_back(pixmap);
+		pt.glxPixmaps.push_back(glxPixmap);
+	}
+
+	DirtyRegion all;
+	all.add(Rect{0, 0, st.width, st.height});
+	refreshPixmapTextures(pt, st, all);
+	return true;
+}
+
+void destroyPixmapTextures(PixmapTextures& pt, ScreenTextures& st) {
+	releasePixmapTextures(pt, st);
+	if (pt.gc) {
+		XFreeGC(pt.display, pt.gc);
+		pt.gc = nullptr;
+	}
+}
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <cstdint>
+#include <iterator>
+#include <vector>
+
+#include <glad/glad.h>
+
+#include "capture/layout.hpp"
+#include "capture/pixel_format.hpp"
+#include "capture/source.hpp"
+
+// The captured screen as one texture per output, each drawn as a quad at
+// the output's place in the root window.
+struct ScreenTextures {
+	std::vector<Output> outputs;
+	std::vector<GLuint> textures;
+	// size of the root window, i.e. u_screenshotSize
+	int width;
+	int height;
+	// set when the textures' first row is the bottom of the output rather
+	// than the top, which is up to the driver for pixmap-backed textures
+	bool flipY;
+	// what the textures hold, one of the formats textureFormat() returns;
+	// takes effect at the next syncScreenTextures
+	PixelFormat format;
+	// what the current textures were created as
+	PixelFormat allocated;
+	// the textures hold the outputs at 1/divisor of their resolution (see
+	// CaptureSource::setDivisor); takes effect at the next syncScreenTextures
+	int divisor;
+	int allocatedDivisor;
+	GLuint vao;
+	GLuint vbo;
+};
+
+GLuint createScreenTexture(int width, int height, PixelFormat format = PixelFormat::BGRA8888) {
+	GLuint tex;
+	glGenTextures(1, &tex);
+	glBindTexture(GL_TEXTURE_2D, tex);
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	bool deep = format == PixelFormat::ARGB2101010;
+	glTexImage2D(GL_TEXTURE_2D,
+		0,
+		deep ? GL_RGB10_A2 : GL_RGBA8,
+		width,
+		height,
+		0,
+		GL_BGRA,
+		deep ? GL_UNSIGNED_INT_2_10_10_10_REV : GL_UNSIGNED_BYTE,
+		nullptr
+	);
+
+	return tex;
+}
+
+void initScreenTextures(ScreenTextures& st) {
+	st = ScreenTextures{};
+	st.divisor = 1;
+	st.allocatedDivisor = 1;
+
+	glGenVertexArrays(1, &st.vao);
+	glGenBuffers(1, &st.vbo);
+
+	glBindVertexArray(st.vao);
+	glBindBuffer(GL_ARRAY_BUFFER, st.vbo);
+
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0);
+	glEnableVertexAttribArray(0);
+
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)(2 * sizeof(float)));
+	glEnableVertexAttribArray(1);
+}
+
+// Makes the textures match `outputs` in a root window of `width` x `height`.
+// Textures of outputs that kept their place, size and format are kept as
+// they are, the others are reallocated and left empty until uploaded to.
+// Quads always cover the outputs' bounds, whatever the divisor.
+void syncScreenTextures(ScreenTextures& st, const std::vector<Output>& outputs, int width, int height) {
+	std::vector<GLuint> textures;
+	std::vector<bool> reused(st.textures.size(), false);
+	bool keep = st.allocated == st.format && st.allocatedDivisor == st.divisor;
+
+	for (const Output& out : outputs) {
+		GLuint tex = 0;
+		for (std::size_t i = 0; keep && i < st.outputs.size(); i++) {
+			if (!reused[i] && st.outputs[i].bounds == out.bounds) {
+				tex = st.textures[i];
+				reused[i] = true;
+				break;
+			}
+		}
+
+		if (!tex) {
+			Rect size = out.bounds.scaledDown(st.divisor);
+			tex = createScreenTexture(size.width, size.height, st.format);
+		}
+		textures.push_back(tex);
+	}
+
+	for (std::size_t i = 0; i < st.textures.size(); i++) {
+		if (!reused[i]) {
+			glDeleteTextures(1, &st.textures[i]);
+		}
+	}
+
+	st.outputs = outputs;
+	st.textures = std::move(textures);
+	st.allocated = st.format;
+	st.allocatedDivisor = st.divisor;
+	st.width = width;
+	st.height = height;
+
+	// The vertex shader has y pointing up, so an output's rows are flipped
+	// relative to the root window.
+	std::vector<float> quads;
+	for (const Output& out : outputs) {
+		float x0 = (float)out.bounds.x;
+		float x1 = (float)out.bounds.right();
+		float y0 = (float)(height - out.bounds.bottom());
+		float y1 = (float)(height - out.bounds.y);
+
+		float t0 = st.flipY ? 1.0f : 0.0f;
+		float t1 = 1.0f - t0;
+
+		float quad[] = {
+			x0, y0,     0, t0,
+			x1, y0,     1, t0,
+			x1, y1,     1, t1,
+
+			x0, y0,     0, t0,
+			x1, y1,     1, t1,
+			x0, y1,     0, t1
+		};
+		quads.insert(quads.end(), std::begin(quad), std::end(quad));
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, st.vbo);
+	glBufferData(GL_ARRAY_BUFFER, quads.size() * sizeof(float), quads.data(), GL_STATIC_DRAW);
+}
+
+// Fills every texture with a neutral grey, shown wherever nothing was
+// uploaded yet
+void clearScreenTextures(ScreenTextures& st) {
+	const std::uint8_t grey[4] = {0x40, 0x40, 0x40, 0xff};
+	for (GLuint tex : st.textures) {
+		glClearTexImage(tex, 0, GL_BGRA, GL_UNSIGNED_BYTE, grey);
+	}
+}
+
+// Uploads pixels of `format` covering `rect` (in root coordinates divided by
+// the divisor, and inside the bounds of output `index`). Formats GL can't
+// take as they are are converted first.
+void uploadScreenTexture(ScreenTextures& st, std::size_t index, const Rect& rect, const std::uint8_t* pixels, int stride,
+	PixelFormat format = PixelFormat::BGRA8888)
+{
+	Rect bounds = st.outputs[index].bounds.scaledDown(st.allocatedDivisor);
+
+	PixelFormat upload = textureFormat(format);
+	if (upload != format) {
+		static std::vector<std::uint8_t> converted;
+		converted.resize((std::size_t)rect.width * rect.height * 4);
+		convertPixels(format, pixels, stride, converted.data(), rect.width * 4, rect.width, rect.height);
+		pixels = converted.data();
+		stride = rect.width * 4;
+	}
+
+	glBindTexture(GL_TEXTURE_2D, st.textures[index]);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, stride / 4);
+	glTexSubImage2D(GL_TEXTURE_2D,
+		0,
+		rect.x - bounds.x, rect.y - bounds.y,
+		rect.width,
+		rect.height,
+		GL_BGRA,
+		upload == PixelFormat::ARGB2101010 ? GL_UNSIGNED_INT_2_10_10_10_REV : GL_UNSIGNED_BYTE,
+		pixels
+	);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+// Captures output `index` in full with `src` and uploads the result
+bool refreshScreenTexture(ScreenTextures& st, std::size_t index, CaptureSource& src) {
+	if (!src.grab()) {
+		return false;
+	}
+
+	ImageView img = src.image();
+	uploadScreenTexture(st, index, src.area(), img.data, img.stride, img.format);
+	return true;
+}
+
+void drawScreenTextures(ScreenTextures& st) {
+	glActiveTexture(GL_TEXTURE0);
+	glBindVertexArray(st.vao);
+
+	for (std::size_t i = 0; i < st.textures.size(); i++) {
+		glBindTexture(GL_TEXTURE_2D, st.textures[i]);
+		glDrawArrays(GL_TRIANGLES, (GLint)(i * 6), 6);
+	}
+}
+
+void destroyScreenTextures(ScreenTextures& st) {
+	for (GLuint tex : st.textures) {
+		glDeleteTextures(1, &tex);
+	}
+	st.textures.clear();
+	st.outputs.clear();
+
+	glDeleteVertexArrays(1, &st.vao);
+	glDeleteBuffers(1, &st.vbo);
+}
@@ -11,11 +11,32 @@ uniform float u_flShadow;
 uniform float u_flRadius;
 uniform float u_cameraScale;
 
+// pointer image (premultiplied), drawn magnified with its hot spot at
+// u_cursorPos. No pointer is drawn while u_cursorSize is 0.
+uniform sampler2D u_cursorTex;
+uniform vec2 u_cursorSize;
+uniform vec2 u_cursorHot;
+
+vec4 withPointer(vec4 color) {
+	if (u_cursorSize.x == 0.0) {
+		return color;
+	}
+
+	vec2 frag = vec2(gl_FragCoord.x, u_windowSize.y - gl_FragCoord.y);
+	vec2 local = (frag - u_cursorPos) / u_cameraScale + u_cursorHot;
+	if (any(lessThan(local, vec2(0.0))) || any(greaterThanEqual(local, u_cursorSize))) {
+		return color;
+	}
+
+	vec4 pointer = texture(u_cursorTex, local / u_cursorSize);
+	return vec4(pointer.rgb + color.rgb * (1.0 - pointer.a), 1.0);
+}
+
 void main() {
 	vec4 cursor = vec4(u_cursorPos.x, u_windowSize.y - u_cursorPos.y, 0.0, 1.0);
 
 	fragColor = mix(
-		texture(u_tex, vTexCoord), 
+		withPointer(texture(u_tex, vTexCoord)), 
 		vec4(0.0, 0.0, 0.0, 0.0),
 		length(cursor - gl_FragCoord) < (u_flRadius * u_cameraScale) ? 0.0 : u_flShadow
 	);
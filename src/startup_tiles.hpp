@@ -0,0 +1,167 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+
+#include "capture/layout.hpp"
+#include "capture/pixel_format.hpp"
+#include "capture/region.hpp"
+#include "capture/shm.hpp"
+#include "screen_textures.hpp"
+
+// Side of the square tiles the screen is streamed in at startup
+const int STARTUP_TILE_SIZE = 256;
+// How long each frame may spend reading and uploading tiles, in milliseconds
+const double STARTUP_TILE_BUDGET_MS = 4.0;
+
+struct StartupTile {
+	// in root coordinates, inside the bounds of output `output`
+	Rect rect;
+	std::size_t output;
+};
+
+// Gets the screen into the textures a tile at a time, nearest the pointer
+// first, so the first frame can be shown before the whole screen is read.
+//
+// The screen is first frozen into a pixmap on the server with a plain copy,
+// which costs next to nothing on an accelerated server, before the overlay
+// is mapped. Tiles are then read from that pixmap, so the overlay covering
+// the screen by then doesn't end up in them. Until its tile arrives, every
+// part of the screen shows a neutral grey.
+struct StartupTiles {
+	Display* display;
+	Pixmap snapshot;
+	Visual* visual;
+	int depth;
+	PixelFormat format;
+	// MIT-SHM works with this server, XGetImage is used otherwise
+	bool shm;
+
+	// layout the tiles refer to
+	std::vector<Output> outputs;
+	int width;
+	int height;
+
+	std::vector<StartupTile> tiles;
+	// first tile not uploaded yet
+	std::size_t next;
+};
+
+// Freezes the screen and orders the tiles of `outputs` by their distance to
+// (px, py). Returns false if the screen's pixels can't be read, in which case
+// the caller should capture the usual way.
+bool initStartupTiles(StartupTiles& st, Display* display, Window root, const std::vector<Output>& outputs, int px, int py) {
+	st = StartupTiles{};
+	st.display = display;
+
+	int screen = DefaultScreen(display);
+	st.visual = DefaultVisual(display, screen);
+	st.depth = DefaultDepth(display, screen);
+	st.width = DisplayWidth(display, screen);
+	st.height = DisplayHeight(display, screen);
+	st.outputs = outputs;
+
+	st.snapshot = XCreatePixmap(display, root, st.width, st.height, st.depth);
+
+	XGCValues values{};
+	values.subwindow_mode = IncludeInferiors;
+	GC gc = XCreateGC(display, root, GCSubwindowMode, &values);
+	XCopyArea(display, root, st.snapshot, gc, 0, 0, st.width, st.height, 0, 0);
+	XFreeGC(display, gc);
+
+	// the copy is done once this returns, whatever gets mapped afterwards
+	XImage* probe = XGetImage(display, st.snapshot, 0, 0, 1, 1, AllPlanes, ZPixmap);
+	st.format = probe ? pixelFormatOf(probe) : PixelFormat::Unknown;
+	if (probe) {
+		XDestroyImage(probe);
+	}
+
+	if (st.format == PixelFormat::Unknown) {
+		XFreePixmap(display, st.snapshot);
+		st.snapshot = None;
+		return false;
+	}
+
+	st.shm = XShmQueryExtension(display);
+
+	for (std::size_t i = 0; i < outputs.size(); i++) {
+		const Rect& b = outputs[i].bounds;
+		for (int y = b.y; y < b.bottom(); y += STARTUP_TILE_SIZE) {
+			for (int x = b.x; x < b.right(); x += STARTUP_TILE_SIZE) {
+				Rect tile{x, y, std::min(STARTUP_TILE_SIZE, b.right() - x), std::min(STARTUP_TILE_SIZE, b.bottom() - y)};
+				st.tiles.push_back(StartupTile{tile, i});
+			}
+		}
+	}
+
+	auto distance = [&](const StartupTile& t) {
+		std::int64_t dx = t.rect.x + t.rect.width / 2 - px;
+		std::int64_t dy = t.rect.y + t.rect.height / 2 - py;
+		return dx * dx + dy * dy;
+	};
+	std::stable_sort(st.tiles.begin(), st.tiles.end(), [&](const StartupTile& a, const StartupTile& b) {
+		return distance(a) < distance(b);
+	});
+	return true;
+}
+
+void destroyStartupTiles(StartupTiles& st) {
+	if (st.snapshot) {
+		XFreePixmap(st.display, st.snapshot);
+		st.snapshot = None;
+	}
+	st.tiles.clear();
+}
+
+// Reads one tile out of the snapshot and uploads it
+static bool uploadStartupTile(StartupTiles& st, ScreenTextures& tex, const StartupTile& tile) {
+	if (st.shm) {
+		ShmCapture cap{};
+		if (initShmCapture(cap, st.display, st.snapshot, st.visual, st.depth, tile.rect)) {
+			bool ok = capture(cap);
+			if (ok) {
+				uploadScreenTexture(tex, tile.output, tile.rect,
+					(const std::uint8_t*)cap.image->data, cap.image->bytes_per_line, cap.format);
+			}
+			destroyShmCapture(cap);
+			return ok;
+		}
+		st.shm = false;
+	}
+
+	XImage* img = XGetImage(st.display, st.snapshot,
+		tile.rect.x, tile.rect.y, tile.rect.width, tile.rect.height, AllPlanes, ZPixmap);
+	if (!img) {
+		return false;
+	}
+	uploadScreenTexture(tex, tile.output, tile.rect, (const std::uint8_t*)img->data, img->bytes_per_line, st.format);
+	XDestroyImage(img);
+	return true;
+}
+
+// Uploads tiles until `budgetMs` is spent, always at least one. Returns true
+// once every tile is uploaded; the snapshot can then be destroyed.
+bool streamStartupTiles(StartupTiles& st, ScreenTextures& tex, double budgetMs) {
+	auto start = std::chrono::steady_clock::now();
+
+	while (st.next < st.tiles.size()) {
+		if (!uploadStartupTile(st, tex, st.tiles[st.next])) {
+			fprintf(stderr, "[WARN] Couldn't read the startup tile at %d,%d\n",
+				st.tiles[st.next].rect.x, st.tiles[st.next].rect.y);
+		}
+		st.next++;
+
+		std::chrono::duration<double, std::milli> spent = std::chrono::steady_clock::now() - start;
+		if (spent.count() >= budgetMs) {
+			break;
+		}
+	}
+	return st.next == st.tiles.size();
+}
@@ -0,0 +1,227 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <vector>
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+#include <glm/glm.hpp>
+
+#include "gl_utils.hpp"
+#include "nav.hpp"
+#include "config.hpp"
+#include "capture/wayland.hpp"
+#include "screen_textures.hpp"
+
+// Factors out the code that is independent of platform
+// e.g.: flashlight, camera, uniforms, etc.
+#include "common.hpp"
+
+// Makes the textures match the outputs captured so far
+static void syncWaylandTextures(ScreenTextures& st, const WaylandCapture& wc) {
+	int width, height;
+	std::vector<Output> layout = waylandLayout(wc, width, height);
+
+	// the compositor decides per frame, in practice it's the same for all
+	bool flipY = false;
+	for (const auto& out : wc.outputs) {
+		flipY = flipY || (out->buffer && out->yInverted);
+	}
+
+	st.flipY = flipY;
+	syncScreenTextures(st, layout, width, height);
+
+	ctx.ssWidth = st.width; ctx.ssHeight = st.height;
+}
+
+// Uploads the new frame of every output that has one
+static void uploadWaylandFrames(ScreenTextures& st, WaylandCapture& wc) {
+	for (std::size_t i = 0; i < st.outputs.size(); i++) {
+		WaylandOutput* out = findWaylandOutput(wc, st.outputs[i].id);
+		if (!out || out->state != FrameState::Ready) {
+			continue;
+		}
+		out->state = FrameState::Idle;
+
+		const Rect& bounds = st.outputs[i].bounds;
+		Rect r = Rect{0, 0, out->width, out->height}.intersect(Rect{0, 0, bounds.width, bounds.height});
+		if (r.empty()) {
+			continue;
+		}
+
+		uploadScreenTexture(st, i,
+			Rect{bounds.x, bounds.y, r.width, r.height},
+			out->pixels,
+			out->stride
+		);
+	}
+}
+
+int main(int argc, char** argv) {
+	// There is no live mode: screencopy captures whole outputs, and our
+	// fullscreen window would be in every frame after the first
+	if (argc > 1) {
+		fprintf(stderr, "[ERROR] Unknown argument '%s'\n", argv[1]);
+		fprintf(stderr, "Usage: %s\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	// The screen has to be captured before our own window shows up
+	WaylandCapture capture;
+	if (!initWaylandCapture(capture) || !captureWaylandOutputs(capture)) {
+		fprintf(stderr, "[ERROR] Couldn't capture the screen!\n");
+		destroyWaylandCapture(capture);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!glfwInit()) {
+		fprintf(stderr, "[ERROR] Failed to initialize GLFW!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_COMPAT_PROFILE);
+
+	// Disable window header
+	glfwWindowHint(GLFW_DECORATED, GLFW_FALSE);
+
+	GLFWmonitor* monitor = glfwGetPrimaryMonitor();
+
+	if (!monitor) {
+		fprintf(stderr, "[ERROR] Couldn't get primary monitor!\n");
+		glfwTerminate();
+		exit(EXIT_FAILURE);
+	}
+
+	const GLFWvidmode* mode = glfwGetVideoMode(monitor);
+
+	if (!mode) {
+		fprintf(stderr, "[ERROR] Couldn't get video mode from monitor!\n");
+		glfwTerminate();
+		exit(EXIT_FAILURE);
+	}
+
+	float fps = (float)mode->refreshRate;
+
+	// Wayland clients can't place themselves on top of everything, being
+	// fullscreen is the closest we get
+	GLFWwindow* window = glfwCreateWindow(
+		mode->width, mode->height,
+		"clearview",
+		monitor,
+		nullptr
+	);
+
+	if (!window) {
+		fprintf(stderr, "[ERROR] Failed to create GLFW window!\n");
+		glfwTerminate();
+		exit(EXIT_FAILURE);
+	}
+
+	glfwMakeContextCurrent(window);
+
+	glfwSetScrollCallback(window, scrollCallback);
+	glfwSetKeyCallback(window, keyCallback);
+
+	if (!gladLoadGL()) {
+		fprintf(stderr, "[ERROR] Failed to initialize GLAD!\n");
+		glfwDestroyWindow(window);
+		glfwTerminate();
+		exit(EXIT_FAILURE);
+	}
+
+	printf("[INFO] OpenGL version: %s\n", glGetString(GL_VERSION));
+
+	ScreenTextures screenTex;
+	initScreenTextures(screenTex);
+	syncWaylandTextures(screenTex, capture);
+	capture.layoutDirty = false;
+	uploadWaylandFrames(screenTex, capture);
+
+	GLuint program = loadShader(
+		"../src/shaders/vert.glsl",
+		"../src/shaders/frag.glsl"
+	);
+	glUseProgram(program);
+	glUniform1i(glGetUniformLocation(program, "u_tex"), 0);
+
+	{
+		double m_x, m_y;
+		glfwGetCursorPos(window, &m_x, &m_y);
+		glm::vec2 pos = glm::vec2((float)m_x, (float)m_y);
+		ctx.mouse.current = pos;
+		ctx.mouse.previous = pos;
+	}
+
+	ctx.fl.radius = 200.0f;
+	ctx.fl.isEnabled = false;
+	ctx.cfg = defaultConfig;
+
+	float prevTime, currTime;
+
+	float dt = 0.0f;
+
+	while (!glfwWindowShouldClose(window)) {
+		glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
+		glClear(GL_COLOR_BUFFER_BIT);
+
+		prevTime = currTime;
+		currTime = (float)glfwGetTime();
+		dt = std::max(0.0f, currTime - prevTime);
+
+		// get window size
+		int w, h;
+		glfwGetFramebufferSize(window, &w, &h);
+		ctx.windowSize = glm::vec2((float)w, (float)h);
+
+		// update mouse & camera position
+		{
+			double m_x, m_y;
+			glfwGetCursorPos(window, &m_x, &m_y);
+			ctx.mouse.current = glm::vec2((float)m_x, (float)m_y);
+		}
+
+		int lmbState = glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT);
+
+		if (!ctx.mouse.dragging && lmbState == GLFW_PRESS) {
+			ctx.mouse.previous = ctx.mouse.current;
+			ctx.mouse.dragging = true;
+			ctx.camera.velocity = glm::vec2(0.0f, 0.0f);
+		}
+		else if (lmbState == GLFW_RELEASE) {
+			ctx.mouse.dragging = false;
+		}
+
+		if (ctx.mouse.dragging) {
+			glm::vec2 delta = ctx.camera.world(ctx.mouse.previous) - ctx.camera.world(ctx.mouse.current);
+			ctx.camera.position += delta;
+			ctx.camera.velocity = delta * fps;
+		}
+
+		ctx.mouse.previous = ctx.mouse.current;
+
+		// update camera with new mouse
+
+		ctx.camera.update(ctx.cfg, dt, ctx.mouse, ctx.windowSize);
+
+		// update flashlight
+		ctx.fl.update(dt);
+
+		// update the uniforms
+		updateUniforms(program);
+
+		drawScreenTextures(screenTex);
+
+		glfwSwapBuffers(window);
+		glfwPollEvents();
+	}
+
+	destroyWaylandCapture(capture);
+	destroyScreenTextures(screenTex);
+	glfwDestroyWindow(window);
+	glfwTerminate();
+	return 0;
+}
@@ -10,112 +10,84 @@
 #include <X11/Xutil.h>
 #include <X11/extensions/XShm.h>
 
-#include <sys/ipc.h>
-#include <sys/shm.h>
-
 #include <cstdlib>
 #include <cstring>
 #include <cstdint>
+#include <memory>
 #include <cmath>
+#include <string>
 
 #include "gl_utils.hpp"
 #include "nav.hpp"
 #include "config.hpp"
-
-struct ShmCapture {
-	Display* display;
-	Window root;
-	XImage* image;
-	XShmSegmentInfo shmInfo;
-	int width;
-	int height;
-	std::uint8_t* pixels;
-};
-
-ShmCapture initShmCapture()
-{
-    ShmCapture cap{};
-
-    cap.display = XOpenDisplay(nullptr);
-
-    if (!cap.display) {
-    	fprintf(stderr, "[ERROR] Couldn't open display!\n");
-    	exit(EXIT_FAILURE);
-    }
-
-    int screen = DefaultScreen(cap.display);
-    cap.root = RootWindow(cap.display, screen);
-
-    cap.width  = DisplayWidth(cap.display, screen);
-    cap.height = DisplayHeight(cap.display, screen);
-
-    cap.image = XShmCreateImage(
-        cap.display,
-        DefaultVisual(cap.display, screen),
-        DefaultDepth(cap.display, screen),
-        ZPixmap,
-        nullptr,
-        &cap.shmInfo,
-        cap.width,
-        cap.height
-    );
-
-    if (!cap.image) {
-    	fprintf(stderr, "[ERROR] Failed to create image!\n");
-    	exit(EXIT_FAILURE);
-    }
-
-    // Allocate shared memory
-    cap.shmInfo.shmid = shmget(
-        IPC_PRIVATE,
-        cap.image->bytes_per_line * cap.image->height,
-        IPC_CREAT | 0777
-    );
-
-    if (cap.shmInfo.shmid < 0){
-    	fprintf(stderr, "[ERROR] Invalid shm id\n");
-    	exit(EXIT_FAILURE);
-    }
-
-    cap.shmInfo.shmaddr = (char*)shmat(cap.shmInfo.shmid, nullptr, 0);
-    cap.image->data = cap.shmInfo.shmaddr;
-    cap.shmInfo.readOnly = False;
-
-    // Attach shared memory to X server
-    if (!XShmAttach(cap.display, &cap.shmInfo)) {
-    	fprintf(stderr, "[ERROR] Failed to attach display to X server!\n");
-    	exit(EXIT_FAILURE);
-    }
-
-    XSync(cap.display, False);
-
-    return cap;
-}
-
-void destroyShmCapture(ShmCapture& cap) {
-	XShmDetach(cap.display, &cap.shmInfo);
-	XDestroyImage(cap.image);
-
-	shmdt(cap.shmInfo.shmaddr);
-	shmctl(cap.shmInfo.shmid, IPC_RMID, nullptr);
-
-	XCloseDisplay(cap.display);
-}
-
-void capture(ShmCapture& cap) {
-	XShmGetImage(cap.display,
-		cap.root,
-		cap.image,
-		0, 0,
-		AllPlanes
-	);
-}
+#include "capture/chain.hpp"
+#include "capture/live.hpp"
+#include "capture/roi.hpp"
+#include "capture/outputs.hpp"
+#include "capture/xlib.hpp"
+#include "screen_textures.hpp"
+#include "pixmap_textures.hpp"
+#include "startup_tiles.hpp"
+#include "frame_age.hpp"
+
+#ifdef CAPTURE_XFIXES
+#include "cursor_overlay.hpp"
+#endif
 
 // Factors out the code that is independent of platform
 // e.g.: flashlight, camera, uniforms, etc.
 #include "common.hpp"
+#include "bench.hpp"
+
+int main(int argc, char** argv) {
+	bool live = false;
+	std::string backend;
+	int benchFrames = 0;
+	float capturePhase = DEFAULT_CAPTURE_PHASE_MS;
+	bool logFrameAges = false;
+	for (int i = 1; i < argc; i++) {
+		if (std::strcmp(argv[i], "--live") == 0) {
+			live = true;
+		}
+		else if (std::strcmp(argv[i], "--backend") == 0 && i + 1 < argc
+			&& (isCaptureBackend(argv[i + 1]) || std::strcmp(argv[i + 1], PIXMAP_BACKEND) == 0)) {
+			backend = argv[++i];
+		}
+		else if (std::strcmp(argv[i], "--bench") == 0 && i + 1 < argc && std::atoi(argv[i + 1]) > 0) {
+			benchFrames = std::atoi(argv[++i]);
+		}
+		else if (std::strcmp(argv[i], "--huge-pages") == 0) {
+			useShmHugePages(true);
+		}
+		else if (std::strcmp(argv[i], "--capture-phase") == 0 && i + 1 < argc) {
+			capturePhase = (float)std::atof(argv[++i]);
+		}
+		else if (std::strcmp(argv[i], "--frame-ages") == 0) {
+			logFrameAges = true;
+		}
+		else {
+			fprintf(stderr, "[ERROR] Unknown argument '%s'\n", argv[i]);
+			fprintf(stderr, "Usage: %s [--live] [--backend <name>] [--bench <frames>] [--huge-pages] [--capture-phase <ms>] [--frame-ages]\n", argv[0]);
+			fprintf(stderr, "Capture backends: %s", PIXMAP_BACKEND);
+			for (const char* b : CAPTURE_BACKENDS) {
+				fprintf(stderr, " %s", b);
+			}
+			fprintf(stderr, " x11-shm-bands[:N] synthetic[:WxH[:RATE]] file:PATH[:WxH]");
+#ifdef CAPTURE_XCOMPOSITE
+			fprintf(stderr, " window[:active|click|ID]");
+#endif
+#if defined(CAPTURE_XCOMPOSITE) && defined(CAPTURE_XDAMAGE) && defined(CAPTURE_XRENDER)
+			fprintf(stderr, " desktop[:ID]");
+#endif
+			fprintf(stderr, "\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// X errors are logged rather than fatal from here on, for every
+	// connection, including GLFW's
+	installXErrorHandlers();
 
-int main() {
 	if (!glfwInit()) {
 		fprintf(stderr, "[ERROR] Failed to initialize GLFW!\n");
 		exit(EXIT_FAILURE);
@@ -128,6 +100,10 @@ int main() {
 	// Disable window header
 	glfwWindowHint(GLFW_DECORATED, GLFW_FALSE);
 
+	// Stay hidden until the screen is captured, so that the capture doesn't
+	// show us, and windows can be picked by clicking on them
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
 	GLFWmonitor* monitor = glfwGetPrimaryMonitor();
 
 	if (!monitor) {
@@ -189,57 +165,111 @@ int main() {
 
 	printf("[INFO] OpenGL version: %s\n", glGetString(GL_VERSION));
 
-	ShmCapture screen = initShmCapture();
-	capture(screen);
-
-	GLuint screenTex;
-	glGenTextures(1, &screenTex);
-	glBindTexture(GL_TEXTURE_2D, screenTex);
-
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-
-	glTexImage2D(GL_TEXTURE_2D,
-		0,
-		GL_RGBA8,
-		screen.width,
-		screen.height,
-		0,
-		GL_BGRA,
-		GL_UNSIGNED_BYTE,
-		screen.image->data
-	);
+	Display* capDisplay = XOpenDisplay(nullptr);
+	if (!capDisplay) {
+		fprintf(stderr, "[ERROR] Couldn't open display!\n");
+		exit(EXIT_FAILURE);
+	}
+	Window capRoot = DefaultRootWindow(capDisplay);
+
+	OutputTracker outputTracker;
+	initOutputTracker(outputTracker, capDisplay, capRoot);
+
+#ifdef CAPTURE_XCOMPOSITE
+	// pick the window once, so that live capture follows the same one
+	if (backendName(backend) == "window") {
+		backend = resolveWindowSpec(capDisplay, backend);
+		if (backend.empty()) {
+			glfwDestroyWindow(window);
+			glfwTerminate();
+			exit(EXIT_FAILURE);
+		}
+	}
+#endif
+
+	ScreenTextures screenTex;
+	initScreenTextures(screenTex);
+
+	// The zero-copy path binds the screen straight into the textures and
+	// needs none of the capture backends, which are only a fallback here
+	PixmapTextures pixmapTex{};
+	bool usePixmaps = false;
+	if (backend == PIXMAP_BACKEND) {
+		backend = "";
+
+		if (initPixmapTextures(pixmapTex, xdisplay)) {
+			int screenNum = DefaultScreen(capDisplay);
+			screenTex.flipY = !pixmapTex.yInverted;
+			syncScreenTextures(screenTex,
+				queryOutputs(capDisplay, capRoot),
+				DisplayWidth(capDisplay, screenNum),
+				DisplayHeight(capDisplay, screenNum)
+			);
+			usePixmaps = bindPixmapTextures(pixmapTex, screenTex);
+		}
 
-	int sw = screen.width;
-	int sh = screen.height;
+		if (!usePixmaps) {
+			fprintf(stderr, "[WARN] Falling back to the regular capture backends\n");
+			screenTex.flipY = false;
+		}
+	}
 
-	ctx.ssWidth = sw; ctx.ssHeight = sh;
+	// one capture segment and one texture per monitor
+	OutputCaptures screen{};
+	screen.display = capDisplay;
+	initCaptureChain(screen.chain, backend);
+
+	// The screen is normally streamed in from a snapshot, starting around
+	// the pointer, so how soon we show up doesn't depend on its size. The
+	// capture sources are only opened if the monitors change later on.
+	// Benchmarks and standalone backends capture everything up front.
+	StartupTiles startup{};
+	bool progressive = false;
+
+	if (!usePixmaps && benchFrames == 0 && !isStandaloneBackend(backend)) {
+		Window rootRet, childRet;
+		int px = 0, py = 0, wx, wy;
+		unsigned int buttons;
+		XQueryPointer(capDisplay, capRoot, &rootRet, &childRet, &px, &py, &wx, &wy, &buttons);
+
+		progressive = initStartupTiles(startup, capDisplay, capRoot, queryOutputs(capDisplay, capRoot), px, py);
+	}
 
-	float quad[] = {
-		0,   0,     0, 0,
-		sw,  0,     1, 0,
-		sw, sh,     1, 1,
+	if (progressive) {
+		screenTex.format = textureFormat(startup.format);
+		syncScreenTextures(screenTex, startup.outputs, startup.width, startup.height);
+		clearScreenTextures(screenTex);
 
-		0,   0,     0, 0,
-		sw, sh,     1, 1,
-		0,  sh,     0, 1
-	};
+		// only the tile under the pointer makes it into the first frame
+		streamStartupTiles(startup, screenTex, 0.0);
+	}
+	else if (!usePixmaps) {
+		if (isStandaloneBackend(backend)) {
+			openStandaloneCaptures(screen, backend);
+		}
+		else {
+			syncOutputCaptures(screen, queryOutputs(capDisplay, capRoot));
+		}
 
-	GLuint vao, vbo;
-	glGenVertexArrays(1, &vao);
-	glGenBuffers(1, &vbo);
+		if (screen.sources.empty()) {
+			fprintf(stderr, "[ERROR] Couldn't capture the screen with any backend!\n");
+			glfwDestroyWindow(window);
+			glfwTerminate();
+			exit(EXIT_FAILURE);
+		}
 
-	glBindVertexArray(vao);
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+		// 16-bit screens end up in 8-bit textures, 30-bit ones in 10-bit
+		screenTex.format = textureFormat(screen.sources[0]->image().format);
+		syncScreenTextures(screenTex, screen.outputs, screen.width, screen.height);
 
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0);
-	glEnableVertexAttribArray(0);
+		for (std::size_t i = 0; i < screen.sources.size(); i++) {
+			refreshScreenTexture(screenTex, i, *screen.sources[i]);
+		}
+	}
+
+	ctx.ssWidth = screenTex.width; ctx.ssHeight = screenTex.height;
 
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)(2 * sizeof(float)));
-	glEnableVertexAttribArray(1);
+	glfwShowWindow(window);
 
 	GLuint program = loadShader(
 		"../src/shaders/vert.glsl", 
@@ -260,14 +290,171 @@ int main() {
 	ctx.fl.isEnabled = false;
 	ctx.cfg = defaultConfig;
 
+	if (benchFrames > 0) {
+		int w, h;
+		glfwGetFramebufferSize(window, &w, &h);
+		ctx.windowSize = glm::vec2((float)w, (float)h);
+
+		if (backendName(backend) == "x11-shm-bands") {
+			runBandBenchmark(screen.display, Rect{0, 0, screen.width, screen.height},
+				captureBandCount(backend), benchFrames);
+		}
+
+		if (usePixmaps) {
+			runPixmapBenchmark(window, program, pixmapTex, screenTex, benchFrames);
+		}
+		else {
+			runBenchmark(window, program, screen, screenTex, benchFrames);
+		}
+		glfwSetWindowShouldClose(window, GLFW_TRUE);
+		live = false;
+	}
+
+	// The zero-copy path is cheap enough to keep up to date from the render
+	// loop itself, the capture thread is only for the other backends
+	bool livePixmaps = live && usePixmaps;
+	live = live && !usePixmaps;
+
+#if defined(CAPTURE_XCOMPOSITE) && defined(CAPTURE_XDAMAGE) && defined(CAPTURE_XRENDER)
+	// The root would show the overlay too, so the pixmaps are copied from
+	// the desktop assembled without it, and only where it was composited
+	// again. Its pixmap lives on our capture connection.
+	auto pixmapDesktop = std::make_unique<DesktopCompositor>();
+	if (livePixmaps && !pixmapDesktop->open(capDisplay, xwin)) {
+		fprintf(stderr, "[WARN] Live capture can't leave the overlay out, showing the startup capture\n");
+		livePixmaps = false;
+	}
+#else
+	if (livePixmaps) {
+		fprintf(stderr, "[WARN] Live capture needs XComposite, XDamage and XRender to leave the overlay out, showing the startup capture\n");
+		livePixmaps = false;
+	}
+#endif
+
+#ifdef CAPTURE_XFIXES
+	// captures never contain the pointer, in live mode it's drawn on top
+	CursorOverlay cursor{};
+	bool hasCursor = (live || livePixmaps) && initCursorOverlay(cursor, capDisplay, capRoot);
+#endif
+
+	LiveCapture liveCapture;
+	LiveStats lastStats{};
+	// capture times of the pixels in the textures
+	TileClock liveTiles;
+	FrameAges frameAges{};
+	double lastReport = glfwGetTime();
+
+	if (live) {
+		// The overlay covers the screen, so capturing the root would show
+		// the magnifier magnifying itself. Unless told otherwise the capture
+		// thread assembles the desktop from every other window instead, and
+		// live mode is off if it can't.
+		std::string liveBackend = backend;
+#if defined(CAPTURE_XCOMPOSITE) && defined(CAPTURE_XDAMAGE) && defined(CAPTURE_XRENDER)
+		if (liveBackend.empty()) {
+			char desktop[32];
+			std::snprintf(desktop, sizeof(desktop), "desktop:0x%lx", xwin);
+			liveBackend = desktop;
+		}
+#endif
+		liveCapture.setCapturePhase(capturePhase);
+		if (liveBackend.empty()) {
+			fprintf(stderr, "[WARN] Live capture needs XComposite, XDamage and XRender to leave the overlay out, showing the startup capture\n");
+			live = false;
+		}
+		else if (!liveCapture.start(fps, liveBackend)) {
+			fprintf(stderr, "[WARN] Live capture unavailable, showing the startup capture\n");
+			live = false;
+		}
+	}
+
 	float prevTime, currTime;
 
 	float dt = 0.0f;
 
+	// what the last frame drawn showed
+	ViewState lastView{};
+
 	while (!glfwWindowShouldClose(window)) {
 		glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
 		glClear(GL_COLOR_BUFFER_BIT);
 
+		// In live mode a frame is only drawn if it would differ from the
+		// last one: new pixels arrived, or the view or pointer moved
+		bool redraw = !live || progressive;
+
+		// monitors plugged, unplugged or reconfigured
+		while (XPending(capDisplay) > 0) {
+			XEvent ev;
+			XNextEvent(capDisplay, &ev);
+			handleOutputEvent(outputTracker, ev);
+#if defined(CAPTURE_XCOMPOSITE) && defined(CAPTURE_XDAMAGE) && defined(CAPTURE_XRENDER)
+			if (livePixmaps) {
+				pixmapDesktop->handleEvent(ev);
+			}
+#endif
+#ifdef CAPTURE_XFIXES
+			handleCursorEvent(cursor, ev);
+#endif
+		}
+
+		if (outputTracker.dirty && usePixmaps) {
+			outputTracker.dirty = false;
+			releasePixmapTextures(pixmapTex, screenTex);
+
+			int screenNum = DefaultScreen(capDisplay);
+			syncScreenTextures(screenTex,
+				queryOutputs(capDisplay, capRoot),
+				DisplayWidth(capDisplay, screenNum),
+				DisplayHeight(capDisplay, screenNum)
+			);
+			ctx.ssWidth = screenTex.width; ctx.ssHeight = screenTex.height;
+
+			if (!bindPixmapTextures(pixmapTex, screenTex)) {
+				fprintf(stderr, "[ERROR] Couldn't rebind the screen after the monitors changed\n");
+			}
+		}
+		else if (outputTracker.dirty && !screen.standalone) {
+			outputTracker.dirty = false;
+
+			// the snapshot's layout is gone, every output gets captured anew
+			if (progressive) {
+				destroyStartupTiles(startup);
+				progressive = false;
+			}
+
+			// In live mode the capture thread follows the change on its own
+			// and sends the new layout along with its next frame. Otherwise
+			// the sources are only opened now, on the first change, since
+			// measuring the backends takes a few full captures per output.
+			if (!live) {
+				DirtyRegion fresh = syncOutputCaptures(screen, queryOutputs(capDisplay, capRoot));
+				if (screen.sources.empty()) {
+					fprintf(stderr, "[WARN] No capture backend works, monitor changes won't be followed\n");
+				}
+
+				syncScreenTextures(screenTex, screen.outputs, screen.width, screen.height);
+				ctx.ssWidth = screenTex.width; ctx.ssHeight = screenTex.height;
+
+				for (std::size_t i = 0; i < screen.sources.size(); i++) {
+					bool isNew = false;
+					for (const Rect& r : fresh.rects()) {
+						isNew = isNew || !r.intersect(screen.outputs[i].bounds).empty();
+					}
+					if (!isNew) {
+						continue;
+					}
+
+					refreshScreenTexture(screenTex, i, *screen.sources[i]);
+				}
+			}
+		}
+
+		if (progressive && streamStartupTiles(startup, screenTex, STARTUP_TILE_BUDGET_MS)) {
+			destroyStartupTiles(startup);
+			progressive = false;
+		}
+
 		prevTime = currTime;
 		currTime = (float)glfwGetTime();
 		dt = std::max(0.0f, currTime - prevTime);
@@ -310,23 +497,172 @@ int main() {
 		// update flashlight
 		ctx.fl.update(dt);
 
+		Rect viewport = viewportRect(
+			ctx.camera,
+			ctx.windowSize,
+			glm::vec2((float)ctx.ssWidth, (float)ctx.ssHeight),
+			ROI_LOOKAHEAD_FRAMES / fps
+		);
+
+		if (live) {
+			liveCapture.setViewport(viewport, cursorRect(
+				ctx.camera,
+				ctx.windowSize,
+				glm::vec2((float)ctx.ssWidth, (float)ctx.ssHeight),
+				ctx.mouse.current
+			));
+			liveCapture.setScale(ctx.camera.scale);
+			liveCapture.setActivity(
+				ctx.camera.animating(ctx.cfg, ctx.mouse),
+				glfwGetWindowAttrib(window, GLFW_FOCUSED) == GLFW_TRUE
+			);
+		}
+
+#if defined(CAPTURE_XCOMPOSITE) && defined(CAPTURE_XDAMAGE) && defined(CAPTURE_XRENDER)
+		if (livePixmaps) {
+			// copy what was composited again
+			DirtyRegion region;
+			ChangeStamp stamp;
+			pixmapDesktop->update();
+			pixmapDesktop->takeDamage(region, stamp);
+
+			if (!region.empty()) {
+				// the copies are made over the GL connection, which must
+				// only see the desktop once it is composited
+				XSync(capDisplay, False);
+				pixmapTex.source = pixmapDesktop->pixmap();
+				refreshPixmapTextures(pixmapTex, screenTex, region);
+			}
+		}
+#endif
+
 		// update the uniforms
 		updateUniforms(program);
 
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, screenTex);
+#ifdef CAPTURE_XFIXES
+		if (hasCursor) {
+			redraw = redraw || cursor.dirty;
+			refreshCursorOverlay(cursor);
+			bindCursorOverlay(cursor, program);
+		}
+#endif
+
+		// pick up the newest frame from the capture thread, if any, and
+		// upload only what changed
+		if (live && liveCapture.poll()) {
+			const Frame& frame = liveCapture.frame();
+			redraw = true;
+
+			// the first frame covers everything and is newer than the snapshot
+			if (progressive) {
+				destroyStartupTiles(startup);
+				progressive = false;
+			}
+
+			if (frame.outputs != screenTex.outputs || frame.width != screenTex.width || frame.height != screenTex.height
+				|| frame.format != screenTex.allocated || frame.divisor != screenTex.allocatedDivisor) {
+				screenTex.format = frame.format;
+				screenTex.divisor = frame.divisor;
+				syncScreenTextures(screenTex, frame.outputs, frame.width, frame.height);
+				ctx.ssWidth = screenTex.width; ctx.ssHeight = screenTex.height;
+			}
+
+			liveTiles = frame.tiles;
+
+			for (const Patch& patch : frame.patches) {
+				uploadScreenTexture(screenTex, patch.output,
+					patch.rect,
+					frame.pixels.data() + patch.offset,
+					patch.stride,
+					frame.format
+				);
+			}
+			frameUploaded(frameAges, frame);
+		}
 
-		glBindVertexArray(vao);
-		glDrawArrays(GL_TRIANGLES, 0, 6);
+		if (live && currTime - lastReport >= 1.0) {
+			LiveStats stats = liveCapture.stats();
+			std::uint64_t dropped = stats.dropped - lastStats.dropped;
+			std::uint64_t late = stats.late - lastStats.late;
+			if (dropped > 0 || late > 0) {
+				fprintf(stderr, "[WARN] Live capture: %llu of %llu frames dropped, %llu late in the last second\n",
+					(unsigned long long)dropped,
+					(unsigned long long)(stats.captured - lastStats.captured),
+					(unsigned long long)late
+				);
+			}
+
+			// the savings are largest while the rate sits still, so this is
+			// printed every interval rather than when the rate changes
+			double elapsed = currTime - lastReport;
+			auto oldest = oldestTile(liveTiles, viewport);
+			std::chrono::duration<double, std::milli> age = oldest == std::chrono::steady_clock::time_point::max()
+				? std::chrono::duration<double, std::milli>(0.0)
+				: std::chrono::steady_clock::now() - oldest;
+			printf("[INFO] Live capture at %ld Hz, %.1f ms CPU/s, %.1f ms/s saved, view captured %.0f ms ago\n",
+				std::lround(stats.rate),
+				(stats.cpuMs - lastStats.cpuMs) / elapsed,
+				(stats.savedMs - lastStats.savedMs) / elapsed,
+				age.count()
+			);
+			printFrameAges(frameAges);
+			resetFrameAges(frameAges);
+			lastStats = stats;
+			lastReport = currTime;
+		}
+
+		ViewState view = currentView();
+		if (!redraw && view == lastView) {
+			// nothing to show, wait for input or the next frame instead
+			glfwWaitEventsTimeout(1.0 / fps);
+			continue;
+		}
+		lastView = view;
+
+		drawScreenTextures(screenTex);
 
 		glfwSwapBuffers(window);
+		if (framePresented(frameAges) && logFrameAges) {
+			printFrameAge(frameAges.last);
+		}
 		glfwPollEvents();
 	}
 
-	destroyShmCapture(screen);
-	glDeleteVertexArrays(1, &vao);
-	glDeleteBuffers(1, &vbo);
-	glDeleteTextures(1, &screenTex);
+	if (live) {
+		liveCapture.stop();
+		LiveStats stats = liveCapture.stats();
+		printf("[INFO] Live capture: %llu frames, %llu dropped, %llu late\n",
+			(unsigned long long)stats.captured,
+			(unsigned long long)stats.dropped,
+			(unsigned long long)stats.late
+		);
+		printf("[INFO] Live capture: %.1f ms CPU, about %.1f ms saved over capturing at %.0f Hz\n",
+			stats.cpuMs,
+			stats.savedMs,
+			fps
+		);
+		if (stats.failed > 0 || xErrors() > 0) {
+			printf("[INFO] Live capture: %llu failed captures, %llu X errors\n",
+				(unsigned long long)stats.failed,
+				(unsigned long long)xErrors()
+			);
+		}
+	}
+
+#ifdef CAPTURE_XFIXES
+	destroyCursorOverlay(cursor);
+#endif
+	if (usePixmaps) {
+		destroyPixmapTextures(pixmapTex, screenTex);
+	}
+#if defined(CAPTURE_XCOMPOSITE) && defined(CAPTURE_XDAMAGE) && defined(CAPTURE_XRENDER)
+	// unredirects the windows, before the connection goes
+	pixmapDesktop.reset();
+#endif
+	destroyStartupTiles(startup);
+	destroyOutputCaptures(screen);
+	XCloseDisplay(capDisplay);
+	destroyScreenTextures(screenTex);
 	glfwDestroyWindow(window);
 	glfwTerminate();
 	return 0;